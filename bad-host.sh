@@ -0,0 +1,49 @@
+#!/bin/bash
+#
+# bad-host.sh - checks that the event loop proxies answer a request for a
+#     name that doesn't resolve with 502 at once, the first time and again
+#     when the failure comes from the DNS cache. proxy_epoll and proxy -u
+#     (io_uring) are tried, each gets the request twice.
+#
+#     usage: ./bad-host.sh
+#
+
+HOST=nosuch.invalid  # RFC 6761: never resolves
+TIMEOUT=10   # seconds curl waits
+MAX_TIME=2   # seconds a request may take
+
+if [ ! -x ./proxy ] || [ ! -x ./proxy_epoll ]; then
+    echo "Error: ./proxy or ./proxy_epoll not found, run make first"
+    exit 1
+fi
+
+port=$(bash ./free-port.sh)
+failed=0
+for cmd in "./proxy_epoll ${port} 1" "./proxy $((port + 1)) -u"; do
+    ${cmd} >/dev/null 2>&1 &
+    proxy_pid=$!
+    sleep 1
+    proxy_port=$(echo ${cmd} | awk '{print $2}')
+    for i in 1 2; do
+        result=$(curl --silent --output /dev/null --max-time ${TIMEOUT} \
+            --write-out "%{http_code} %{time_total}" \
+            --proxy http://localhost:${proxy_port} http://${HOST}/)
+        code=${result% *}
+        secs=${result#* }
+        echo "${cmd%% *} request ${i}: status ${code} after ${secs} s"
+        if [ "${code}" != "502" ] ||
+            awk "BEGIN {exit !(${secs} > ${MAX_TIME})}"; then
+            failed=1
+        fi
+    done
+    kill ${proxy_pid} 2>/dev/null
+    wait 2>/dev/null
+    port=$((port + 2))
+done
+
+if [ ${failed} -ne 0 ]; then
+    echo "Failed: expected 502 within ${MAX_TIME} s"
+    exit 1
+fi
+echo "Passed"
+exit 0
@@ -1,122 +1,859 @@
 #include "cache.h"
 
+#include <stdint.h>
+
 #include "csapp.h"
+#include "http_parse.h"
 
-const int block_size[6] = {1024, 5120, 10240, 20480, 51200, 102400};
-const int block_cnt[6] = {24, 10, 8, 6, 5, 5};
-
-cache_block *cache_lists[LIST_CNT];
-
-void cache_init() {
-    for (int i = 0; i < LIST_CNT; ++i) {
-        /* initialize cache block list */
-        cache_lists[i] =
-            (cache_block *)malloc(block_cnt[i] * sizeof(cache_block));
-        cache_block *this_list = cache_lists[i];
-        /* initialize every block in this list */
-        for (int j = 0; j < block_cnt[i]; ++j) {
-            this_list[j].url = (char *)calloc(MAXLINE, sizeof(char));
-            this_list[j].data = (char *)calloc(block_size[i], sizeof(char));
-            this_list[j].datasize = 0;
-            this_list[j].timestamp = 0;
-            pthread_rwlock_init(&this_list[j].rwlock, NULL);
-        }
+/* evict the least recently hit of this many entries at the old end of the
+ * lru list of a class */
+#define EVICT_SAMPLES 5
+/* every this many allocations in a shard, the class that evicted the most
+ * may take a page from a class that did not evict at all, if it evicted at
+ * least REBALANCE_EVICTS times. see rebalance */
+#define REBALANCE_WINDOW 32
+#define REBALANCE_EVICTS 4
+#define INDEX_MIN_SIZE 64
+/* W-TinyLFU: the window takes 1% of a class, the protected segment 80% of
+ * the rest. at most this many entries are promoted per eviction */
+#define WINDOW_PERCENT 1
+#define PROTECTED_PERCENT 80
+#define PROMOTE_LIMIT 8
+/* count-min sketch: rows of saturating counters, halved every
+ * SKETCH_RESET_FACTOR * width additions so old popularity fades */
+#define SKETCH_ROWS 4
+#define SKETCH_MAX 15
+#define SKETCH_MIN_WIDTH 256
+#define SKETCH_RESET_FACTOR 10
+
+/*
+ * the lru lists of a class. LRU_MAIN is the only list of the plain policy
+ * and the probation segment of W-TinyLFU
+ */
+enum { LRU_MAIN, LRU_WINDOW, LRU_PROTECTED, LRU_CNT };
+
+typedef struct {
+    cache_entry *head, *tail; /* head is the oldest */
+    int len;
+} lru_list;
+
+/*
+ * hash index over the linked entries of a shard: open addressing with linear
+ * probing, keyed by cache_hash(url). a slot with entry == NULL is empty. the
+ * table doubles whenever it gets half full, so probes stay short
+ */
+typedef struct {
+    uint64_t hash;
+    cache_entry *entry;
+} index_slot;
+
+/* the chunks of one size class in one shard */
+typedef struct {
+    cache_entry *free;     /* free chunks, linked by next */
+    lru_list lru[LRU_CNT]; /* linked entries */
+    char **pages;          /* pages cut into our chunks */
+    int npages, cap;
+    int evicts;            /* evictions in this rebalance window */
+} slab_class;
+
+/* a url some thread is fetching from its endserver right now */
+typedef struct flight {
+    uint64_t hash;
+    char *url;
+    int done;    /* the fetcher called cache_flight_end */
+    int waiters; /* threads waiting on cond, the last one frees us */
+    pthread_cond_t cond;
+    struct flight *next;
+} flight;
+
+/*
+ * a shard owns its own slab classes, index and lock, so threads that look
+ * up urls in different shards never touch the same lock. the lock only
+ * guards chunks and linking, never the content of a linked entry
+ */
+typedef struct {
+    slab_class classes[SLAB_MAX_CLASSES];
+    int allocs; /* allocations in this rebalance window */
+    long pages_left; /* pages of our share of the budget not taken yet */
+    uint8_t *sketch; /* SKETCH_ROWS rows of sketch_mask + 1 counters */
+    size_t sketch_mask;
+    long sketch_adds; /* additions since the counters were last halved */
+    index_slot *index;
+    size_t index_mask, nindexed;
+    pthread_rwlock_t lock;
+    flight *flights; /* urls being fetched, guarded by flight_lock */
+    pthread_mutex_t flight_lock;
+} __attribute__((aligned(64))) cache_shard;
+
+static size_t class_size[SLAB_MAX_CLASSES];
+static int class_cnt;
+static int policy;      /* CACHE_LRU or CACHE_TINYLFU */
+static cache_shard *shards;
+static int shard_cnt;
+static int64_t (*timestamp_clock)(void); /* NULL: the wall clock */
+
+static void index_place(cache_shard *shard, uint64_t hash,
+                        cache_entry *entry) {
+    size_t mask = shard->index_mask, i = hash & mask;
+    while (shard->index[i].entry) i = (i + 1) & mask;
+    shard->index[i].hash = hash;
+    shard->index[i].entry = entry;
+}
+
+static void index_insert(cache_shard *shard, cache_entry *entry) {
+    if (2 * (shard->nindexed + 1) > shard->index_mask + 1) {
+        /* rehash everything into a table twice as large */
+        index_slot *old = shard->index;
+        size_t size = shard->index_mask + 1;
+        shard->index = (index_slot *)Calloc(2 * size, sizeof(index_slot));
+        shard->index_mask = 2 * size - 1;
+        for (size_t i = 0; i < size; ++i)
+            if (old[i].entry) index_place(shard, old[i].hash, old[i].entry);
+        free(old);
     }
+    index_place(shard, entry->hash, entry);
+    shard->nindexed++;
 }
 
-void cache_deinit() {
-    for (int i = 0; i < LIST_CNT; ++i) {
-        cache_block *this_list = cache_lists[i];
-        for (int j = 0; j < block_cnt[j]; ++j) {
-            free(this_list[j].url);
-            free(this_list[j].data);
-            pthread_rwlock_destroy(&this_list[j].rwlock);
+static void index_remove(cache_shard *shard, cache_entry *entry) {
+    index_slot *index = shard->index;
+    size_t mask = shard->index_mask, i = entry->hash & mask;
+    while (index[i].entry != entry) {
+        if (index[i].entry == NULL) return; /* not indexed */
+        i = (i + 1) & mask;
+    }
+    /* backward shift: pull later slots of the probe chain into the hole so
+     * lookups never stop early, no tombstones needed */
+    for (size_t j = (i + 1) & mask; index[j].entry; j = (j + 1) & mask) {
+        size_t home = index[j].hash & mask;
+        /* move j into the hole i unless its home lies cyclically in (i, j] */
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            index[i] = index[j];
+            i = j;
         }
-        free(this_list);
     }
+    index[i].entry = NULL;
+    shard->nindexed--;
 }
 
-int cache_read(char *url, int fd) {
-    /* search every list */
-    int cache_hit = 0;
-    cache_block *target = NULL;
-    for (int i = 0; i < LIST_CNT; ++i) {
-        cache_block *this_list = cache_lists[i];
-        /* search every block in this list */
-        for (int j = 0; j < block_cnt[i]; ++j) {
-            /* if uri match, and timestamp not zero(means block valid), then
-             * hit! */
-            if (!strcmp(url, this_list[j].url) && this_list[j].timestamp) {
-                cache_hit = 1;
-                target = &this_list[j];
+/* return the entry whose url equals url, or NULL. caller holds shard->lock */
+static cache_entry *index_find(cache_shard *shard, const char *url,
+                               uint64_t hash) {
+    size_t mask = shard->index_mask;
+    for (size_t i = hash & mask; shard->index[i].entry; i = (i + 1) & mask) {
+        /* the hash only filters, the full key decides */
+        if (shard->index[i].hash == hash &&
+            !strcmp(shard->index[i].entry->url, url))
+            return shard->index[i].entry;
+    }
+    return NULL;
+}
+
+static void lru_append(slab_class *cls, int q, cache_entry *entry) {
+    lru_list *list = &cls->lru[q];
+    entry->lru = q;
+    entry->next = NULL;
+    entry->prev = list->tail;
+    if (list->tail)
+        list->tail->next = entry;
+    else
+        list->head = entry;
+    list->tail = entry;
+    list->len++;
+}
+
+static void lru_remove(slab_class *cls, cache_entry *entry) {
+    lru_list *list = &cls->lru[entry->lru];
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        list->head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        list->tail = entry->prev;
+    list->len--;
+}
+
+/* move entry to the young end of list q, forgetting its hits */
+static void lru_move(slab_class *cls, int q, cache_entry *entry) {
+    lru_remove(cls, entry);
+    __atomic_store_n(&entry->hit, 0, __ATOMIC_RELAXED);
+    lru_append(cls, q, entry);
+}
+
+/* counter of hash in row r of the sketch */
+static uint8_t *sketch_counter(cache_shard *shard, uint64_t hash, int r) {
+    /* remix, the low and high bits of hash already pick slot and shard */
+    uint64_t h = hash * 0x9e3779b97f4a7c15ULL;
+    uint32_t h1 = h >> 32, h2 = (uint32_t)h | 1;
+    size_t width = shard->sketch_mask + 1;
+    return &shard->sketch[r * width + ((h1 + r * h2) & shard->sketch_mask)];
+}
+
+/* count one request for hash. readers call this under the read lock, so
+ * counters are bumped with relaxed atomics and may lose a race now and
+ * then, which a sketch can live with */
+static void sketch_add(cache_shard *shard, uint64_t hash) {
+    for (int r = 0; r < SKETCH_ROWS; ++r) {
+        uint8_t *counter = sketch_counter(shard, hash, r);
+        uint8_t v = __atomic_load_n(counter, __ATOMIC_RELAXED);
+        if (v < SKETCH_MAX) __atomic_store_n(counter, v + 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&shard->sketch_adds, 1, __ATOMIC_RELAXED);
+}
+
+/* estimated recent requests for hash, the smallest of its counters */
+static int sketch_freq(cache_shard *shard, uint64_t hash) {
+    int freq = SKETCH_MAX;
+    for (int r = 0; r < SKETCH_ROWS; ++r) {
+        int v = __atomic_load_n(sketch_counter(shard, hash, r),
+                                __ATOMIC_RELAXED);
+        if (v < freq) freq = v;
+    }
+    return freq;
+}
+
+/*
+ * from here up to cache_get, every function expects shard->lock held for
+ * writing
+ */
+
+/* chunks of class c, linked or not */
+static int class_chunks(cache_shard *shard, int c) {
+    return shard->classes[c].npages * (SLAB_PAGE_SIZE / class_size[c]);
+}
+
+static int window_cap(cache_shard *shard, int c) {
+    int cap = class_chunks(shard, c) * WINDOW_PERCENT / 100;
+    return cap > 0 ? cap : 1;
+}
+
+static void link_entry(cache_shard *shard, cache_entry *entry) {
+    slab_class *cls = &shard->classes[entry->cls];
+    index_insert(shard, entry);
+    entry->state = CHUNK_LINKED;
+    entry->hit = 0;
+    if (policy == CACHE_LRU) {
+        lru_append(cls, LRU_MAIN, entry);
+        return;
+    }
+    /* new entries start in the window. while there is room, whatever
+     * leaves the window goes on to probation without a fight */
+    lru_append(cls, LRU_WINDOW, entry);
+    while (cls->lru[LRU_WINDOW].len > window_cap(shard, entry->cls))
+        lru_move(cls, LRU_MAIN, cls->lru[LRU_WINDOW].head);
+}
+
+/* the caller must drop the cache's reference afterwards */
+static void unlink_entry(cache_shard *shard, cache_entry *entry) {
+    index_remove(shard, entry);
+    lru_remove(&shard->classes[entry->cls], entry);
+    entry->state = CHUNK_UNLINKED;
+}
+
+static void chunk_free(cache_shard *shard, cache_entry *entry) {
+    slab_class *cls = &shard->classes[entry->cls];
+    entry->state = CHUNK_FREE;
+    entry->next = cls->free;
+    cls->free = entry;
+}
+
+static void release_locked(cache_shard *shard, cache_entry *entry) {
+    if (__atomic_sub_fetch(&entry->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+        chunk_free(shard, entry);
+}
+
+/* cut page into free chunks of class c */
+static void page_carve(cache_shard *shard, int c, char *page) {
+    slab_class *cls = &shard->classes[c];
+    if (cls->npages == cls->cap) {
+        cls->cap = cls->cap ? 2 * cls->cap : 4;
+        cls->pages = (char **)Realloc(cls->pages, cls->cap * sizeof(char *));
+    }
+    cls->pages[cls->npages++] = page;
+    for (size_t off = 0; off + class_size[c] <= SLAB_PAGE_SIZE;
+         off += class_size[c]) {
+        cache_entry *entry = (cache_entry *)(page + off);
+        entry->refcnt = 0;
+        entry->cls = c;
+        chunk_free(shard, entry);
+    }
+}
+
+/* take a fresh page out of the shard's share of the budget, NULL if it is
+ * used up */
+static char *page_from_budget(cache_shard *shard) {
+    if (shard->pages_left == 0) return NULL;
+    shard->pages_left--;
+    return (char *)Malloc(SLAB_PAGE_SIZE);
+}
+
+/*
+ * empty a page of class c so it can be given to another class: evict every
+ * entry on it and take its chunks off the free list. a page with a chunk
+ * that a reader pins, or that a writer is filling, is skipped. return the
+ * page, or NULL if no page could be emptied
+ */
+static char *page_reclaim(cache_shard *shard, int c) {
+    slab_class *cls = &shard->classes[c];
+    size_t size = class_size[c];
+
+    for (int p = 0; p < cls->npages; ++p) {
+        char *page = cls->pages[p], *off;
+        int busy = 0;
+        /* refcnt of a linked entry only grows under the read lock, so a
+         * linked entry with refcnt 1 is referenced by the cache alone */
+        for (off = page; off + size <= page + SLAB_PAGE_SIZE; off += size) {
+            cache_entry *entry = (cache_entry *)off;
+            if (entry->state == CHUNK_UNLINKED ||
+                (entry->state == CHUNK_LINKED &&
+                 __atomic_load_n(&entry->refcnt, __ATOMIC_ACQUIRE) > 1)) {
+                busy = 1;
                 break;
             }
         }
-        if (cache_hit) break;
+        if (busy) continue;
+
+        for (off = page; off + size <= page + SLAB_PAGE_SIZE; off += size) {
+            cache_entry *entry = (cache_entry *)off;
+            if (entry->state == CHUNK_LINKED) unlink_entry(shard, entry);
+        }
+        for (cache_entry **pp = &cls->free; *pp;) {
+            if ((char *)*pp >= page && (char *)*pp < page + SLAB_PAGE_SIZE)
+                *pp = (*pp)->next;
+            else
+                pp = &(*pp)->next;
+        }
+        cls->pages[p] = cls->pages[--cls->npages];
+        return page;
     }
-    if (!cache_hit) {
-        printf("no matched cache block\n");
-        return 0;
+    return NULL;
+}
+
+/*
+ * move the page of fill, a chunk that has its page to itself, to the smaller
+ * class c. fill stays where it is as the first chunk of the page, so its
+ * data need not be copied, and the rest of the page is free for class c
+ */
+static cache_entry *page_shrink(cache_shard *shard, cache_entry *fill,
+                                int c) {
+    slab_class *cls = &shard->classes[fill->cls];
+    char *page = (char *)fill, *url;
+    size_t url_len = strlen(fill->url);
+    int p = 0;
+
+    while (cls->pages[p] != page) ++p;
+    cls->pages[p] = cls->pages[--cls->npages];
+    /* carving only writes the headers of chunks past the first one */
+    url = page + class_size[c] - url_len - 1;
+    memmove(url, fill->url, url_len + 1);
+    page_carve(shard, c, page);
+    cache_entry **pp = &shard->classes[c].free;
+    while (*pp != fill) pp = &(*pp)->next;
+    *pp = fill->next;
+    fill->state = CHUNK_UNLINKED;
+    fill->refcnt = 1;
+    fill->url = url;
+    return fill;
+}
+
+/* last hit of the oldest entry of a class, roughly what it would evict
+ * next. a class with pages but no entries has memory to spare */
+static int64_t class_age(slab_class *cls) {
+    int64_t age = INT64_MAX;
+    for (int q = 0; q < LRU_CNT; ++q) {
+        if (cls->lru[q].head == NULL) continue;
+        int64_t t =
+            __atomic_load_n(&cls->lru[q].head->timestamp, __ATOMIC_RELAXED);
+        if (t < age) age = t;
     }
+    return age == INT64_MAX ? INT64_MIN : age;
+}
 
-    /* first update timestamp before block kicked by other thread */
-    pthread_rwlock_wrlock(&target->rwlock);
-    /* we have to check target block again incase other thread kiked it */
-    if (strcmp(url, target->url)) {
-        printf("oops, the matched block modified by other thread just now\n");
-        pthread_rwlock_unlock(&target->rwlock);
-        return 0;
+/*
+ * called at the end of each window of allocations: move one page from a
+ * class that had no evictions (the one whose oldest entry is oldest) to the
+ * class that had the most, as failed allocations count as evictions too. a
+ * move evicts a whole page, so we only do it when the traffic clearly asks
+ * for it
+ */
+static void rebalance(cache_shard *shard) {
+    slab_class *classes = shard->classes;
+    int recv = 0, donor = -1;
+
+    for (int c = 1; c < class_cnt; ++c)
+        if (classes[c].evicts > classes[recv].evicts) recv = c;
+    for (int d = 0; d < class_cnt; ++d) {
+        if (d == recv || classes[d].npages == 0 || classes[d].evicts) continue;
+        if (donor < 0 || class_age(&classes[d]) < class_age(&classes[donor]))
+            donor = d;
     }
-    /* we can update the timestamp safely */
-    target->timestamp = get_timestamp();
-    pthread_rwlock_unlock(&target->rwlock);
+    if (classes[recv].evicts >= REBALANCE_EVICTS && donor >= 0) {
+        char *page = page_reclaim(shard, donor);
+        if (page) {
+            page_carve(shard, recv, page);
+            printf("move a cache page from %zu to %zu byte chunks\n",
+                   class_size[donor], class_size[recv]);
+        }
+    }
+    for (int c = 0; c < class_cnt; ++c) classes[c].evicts = 0;
+    shard->allocs = 0;
+}
 
-    /* now we can get cache content */
-    pthread_rwlock_rdlock(&target->rwlock);
-    /* double check, just in case */
-    if (strcmp(url, target->url)) {
-        printf("oops, the matched block modified by other thread just now\n");
-        pthread_rwlock_unlock(&target->rwlock);
-        return 0;
+static void evict(cache_shard *shard, cache_entry *victim) {
+    unlink_entry(shard, victim);
+    /* if a reader still pins it, its cache_put frees the chunk */
+    release_locked(shard, victim);
+}
+
+/* evict the least recently hit of the oldest few entries of class c. the
+ * others we looked at go to the young end of the list */
+static void evict_lru(cache_shard *shard, int c) {
+    slab_class *cls = &shard->classes[c];
+    cache_entry *victim = cls->lru[LRU_MAIN].head, *entry, *next;
+    int64_t min_timestamp = INT64_MAX;
+    int n = 0;
+
+    for (entry = victim; entry && n < EVICT_SAMPLES; entry = entry->next) {
+        int64_t t = __atomic_load_n(&entry->timestamp, __ATOMIC_RELAXED);
+        if (t < min_timestamp) {
+            victim = entry;
+            min_timestamp = t;
+        }
+        ++n;
+    }
+    for (entry = cls->lru[LRU_MAIN].head; n--; entry = next) {
+        next = entry->next;
+        if (entry != victim) lru_move(cls, LRU_MAIN, entry);
+    }
+    evict(shard, victim);
+}
+
+/*
+ * the entry W-TinyLFU would evict from the main region of class c. hits
+ * do not reorder lists (that would need the write lock), so promotion is
+ * done lazily here: a probation entry that was hit moves to protected, and
+ * protected overflow goes back to probation unless it was hit too
+ */
+static cache_entry *main_victim(cache_shard *shard, int c) {
+    slab_class *cls = &shard->classes[c];
+    lru_list *probation = &cls->lru[LRU_MAIN];
+    lru_list *protected = &cls->lru[LRU_PROTECTED];
+    int main_cap = class_chunks(shard, c) - window_cap(shard, c);
+    int protected_cap = main_cap * PROTECTED_PERCENT / 100;
+    cache_entry *entry;
+
+    for (int i = 0; i < PROMOTE_LIMIT && (entry = probation->head) &&
+                    __atomic_load_n(&entry->hit, __ATOMIC_RELAXED);
+         ++i) {
+        lru_move(cls, LRU_PROTECTED, entry);
+        for (int j = 0; protected->len > protected_cap; ++j) {
+            entry = protected->head;
+            if (j < PROMOTE_LIMIT && __atomic_load_n(&entry->hit,
+                                                     __ATOMIC_RELAXED))
+                lru_move(cls, LRU_PROTECTED, entry); /* second chance */
+            else
+                lru_move(cls, LRU_MAIN, entry);
+        }
+    }
+    return probation->head ? probation->head : protected->head;
+}
+
+/*
+ * make room in a full class c for W-TinyLFU. the new entry will push the
+ * oldest window entry out, and that candidate only gets into the main
+ * region if the sketch says it is asked for more often than the entry the
+ * main region would evict; the loser is evicted
+ */
+static void evict_tinylfu(cache_shard *shard, int c) {
+    slab_class *cls = &shard->classes[c];
+    cache_entry *candidate = NULL, *victim = main_victim(shard, c);
+
+    if (cls->lru[LRU_WINDOW].len >= window_cap(shard, c))
+        candidate = cls->lru[LRU_WINDOW].head;
+    if (candidate == NULL || victim == NULL) {
+        evict(shard, victim ? victim : cls->lru[LRU_WINDOW].head);
+    } else if (sketch_freq(shard, candidate->hash) >
+               sketch_freq(shard, victim->hash)) {
+        lru_move(cls, LRU_MAIN, candidate);
+        evict(shard, victim);
+    } else {
+        /* a rejected candidate is no sign the class is short of memory,
+         * so it does not count for rebalance */
+        evict(shard, candidate);
+        return;
     }
+    cls->evicts++;
+}
+
+/* return an unlinked chunk of class c pinned once, or NULL */
+static cache_entry *chunk_alloc(cache_shard *shard, int c) {
+    slab_class *cls = &shard->classes[c];
+    char *page;
+
+    if (++shard->allocs >= REBALANCE_WINDOW) rebalance(shard);
+    if (policy == CACHE_TINYLFU &&
+        __atomic_load_n(&shard->sketch_adds, __ATOMIC_RELAXED) >=
+            SKETCH_RESET_FACTOR * (long)(shard->sketch_mask + 1)) {
+        /* halve every counter, only recent popularity counts */
+        size_t n = SKETCH_ROWS * (shard->sketch_mask + 1);
+        for (size_t i = 0; i < n; ++i)
+            __atomic_store_n(&shard->sketch[i], shard->sketch[i] >> 1,
+                             __ATOMIC_RELAXED);
+        __atomic_store_n(&shard->sketch_adds, 0, __ATOMIC_RELAXED);
+    }
+    if (cls->free == NULL && (page = page_from_budget(shard)) != NULL)
+        page_carve(shard, c, page);
+    /* W-TinyLFU counts its own evictions, see evict_tinylfu */
+    if (cls->free == NULL && (policy == CACHE_LRU || cls->npages == 0))
+        cls->evicts++;
+    /* pinned victims do not free their chunk yet, so try a few */
+    for (int i = 0; cls->free == NULL && i < EVICT_SAMPLES; ++i) {
+        if (policy == CACHE_LRU && cls->lru[LRU_MAIN].head)
+            evict_lru(shard, c);
+        else if (policy == CACHE_TINYLFU &&
+                 (cls->lru[LRU_MAIN].head || cls->lru[LRU_WINDOW].head ||
+                  cls->lru[LRU_PROTECTED].head))
+            evict_tinylfu(shard, c);
+        else
+            break;
+    }
+    if (cls->free == NULL) return NULL;
+
+    cache_entry *entry = cls->free;
+    cls->free = entry->next;
+    entry->state = CHUNK_UNLINKED;
+    entry->refcnt = 1;
+    return entry;
+}
+
+/* the low bits pick the index slot, so pick the shard with the high ones */
+static cache_shard *shard_of(uint64_t hash) {
+    return &shards[(hash >> 32) % shard_cnt];
+}
+
+uint64_t cache_hash(const char *url) {
+    uint64_t h = 14695981039346656037ULL;
+    for (; *url; ++url) {
+        h ^= (unsigned char)*url;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+void cache_init() { cache_init_opt(CACHE_SHARDS, MAX_CACHE_SIZE, CACHE_LRU); }
+
+void cache_init_opt(int nshards, size_t budget, int cache_policy) {
+    /* each size class SLAB_GROWTH times the last. from an eighth of a page
+     * on, chunks are a page divided by 8, 7, ... 1, so no page has a tail
+     * too short for a chunk that a large class would waste */
+    size_t size = SLAB_MIN_CHUNK;
+    for (class_cnt = 0; size < SLAB_PAGE_SIZE / 8;) {
+        class_size[class_cnt++] = size;
+        size = ((size_t)(size * SLAB_GROWTH) + 7) & ~(size_t)7;
+    }
+    for (int k = 8; k >= 1; --k)
+        class_size[class_cnt++] = (SLAB_PAGE_SIZE / k) & ~(size_t)7;
+    policy = cache_policy;
+
+    /* every shard gets an equal share of the pages, taken lazily. a shard
+     * without a page could cache nothing, so there are no more shards than
+     * pages */
+    long pages = budget / SLAB_PAGE_SIZE;
+    if (nshards > pages) nshards = pages;
+    if (nshards < 1) nshards = 1;
+    shard_cnt = nshards;
+    shards = (cache_shard *)aligned_alloc(64, nshards * sizeof(cache_shard));
+    memset(shards, 0, nshards * sizeof(cache_shard));
+    for (int s = 0; s < nshards; ++s) {
+        cache_shard *shard = &shards[s];
+        shard->pages_left = pages / nshards + (s < pages % nshards);
+        shard->index = (index_slot *)Calloc(INDEX_MIN_SIZE, sizeof(index_slot));
+        shard->index_mask = INDEX_MIN_SIZE - 1;
+        pthread_rwlock_init(&shard->lock, NULL);
+        pthread_mutex_init(&shard->flight_lock, NULL);
+        if (policy == CACHE_TINYLFU) {
+            /* about a counter per KiB of budget, enough for the entries */
+            size_t width = SKETCH_MIN_WIDTH;
+            while (width < budget / nshards / 1024) width <<= 1;
+            shard->sketch = (uint8_t *)Calloc(SKETCH_ROWS * width, 1);
+            shard->sketch_mask = width - 1;
+        }
+    }
+}
+
+void cache_deinit() {
+    for (int s = 0; s < shard_cnt; ++s) {
+        cache_shard *shard = &shards[s];
+        for (int c = 0; c < class_cnt; ++c) {
+            slab_class *cls = &shard->classes[c];
+            for (int p = 0; p < cls->npages; ++p) free(cls->pages[p]);
+            free(cls->pages);
+        }
+        free(shard->index);
+        free(shard->sketch);
+        pthread_rwlock_destroy(&shard->lock);
+        pthread_mutex_destroy(&shard->flight_lock);
+    }
+    free(shards);
+}
+
+/* the entry of url pinned, NULL if there is none or it is stale and
+ * stale_ok isn't set */
+static cache_entry *lookup(char *url, int stale_ok) {
+    uint64_t hash = cache_hash(url);
+    cache_shard *shard = shard_of(hash);
+    pthread_rwlock_rdlock(&shard->lock);
+    /* the sketch counts misses too, they are what admission weighs */
+    if (policy == CACHE_TINYLFU) sketch_add(shard, hash);
+    cache_entry *target = index_find(shard, url, hash);
+    /* a stale entry is a miss, the fresh copy fetched next replaces it */
+    if (target && !stale_ok && target->expires &&
+        time(NULL) >= target->expires)
+        target = NULL;
+    /* pin it before unlocking, so eviction cannot free it under us */
+    if (target) __atomic_add_fetch(&target->refcnt, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&shard->lock);
+    if (target == NULL) {
+        printf("no matched cache block\n");
+        return NULL;
+    }
+    /* the timestamp is only a hint for eviction, readers may race on it, so
+     * a plain atomic store does instead of a write lock */
+    __atomic_store_n(&target->timestamp, get_timestamp(), __ATOMIC_RELAXED);
+    if (!__atomic_load_n(&target->hit, __ATOMIC_RELAXED))
+        __atomic_store_n(&target->hit, 1, __ATOMIC_RELAXED);
+    return target;
+}
+
+cache_entry *cache_get(char *url) { return lookup(url, 0); }
+
+cache_entry *cache_get_stale(char *url) { return lookup(url, 1); }
+
+void cache_put(cache_entry *entry) {
+    /* only an evicted entry can drop to zero, give its chunk back */
+    if (__atomic_sub_fetch(&entry->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        cache_shard *shard = shard_of(entry->hash);
+        pthread_rwlock_wrlock(&shard->lock);
+        chunk_free(shard, entry);
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
+
+int cache_read(char *url, int fd) {
+    cache_entry *target = cache_get(url);
+    if (target == NULL) return 0;
+    /* no lock is held here, a slow client only delays its own entry */
     Rio_writen(fd, target->data, target->datasize);
-    pthread_rwlock_unlock(&target->rwlock);
+    cache_put(target);
     printf("fetch content from cache\n");
     return 1;
 }
 
-void cache_write(char *url, char *data, int len) {
-    int list_idx = 0;
-    cache_block *target = NULL;
-    /* find target list */
-    while ((list_idx < LIST_CNT) && (len > block_size[list_idx])) {
-        ++list_idx;
-    }
-    if (list_idx == LIST_CNT) {
+/* smallest class whose chunk holds an entry with len bytes of data and a
+ * url of url_len, class_cnt if there is none */
+static int class_of(size_t len, size_t url_len) {
+    size_t need = sizeof(cache_entry) + len + url_len + 1;
+    int c = 0;
+    while (c < class_cnt && need > class_size[c]) ++c;
+    return c;
+}
+
+cache_entry *cache_fill_begin(char *url, long size) {
+    uint64_t hash = cache_hash(url);
+    cache_shard *shard = shard_of(hash);
+    size_t url_len = strlen(url);
+    /* not knowing the size, take a chunk that holds the largest object */
+    int c = class_of(size < 0 ? MAX_OBJECT_SIZE : size, url_len);
+    if (size > MAX_OBJECT_SIZE || c == class_cnt) {
         printf("too much data to cache\n");
-        return;
+        return NULL;
     }
-    cache_block *this_list = cache_lists[list_idx];
-    /* find free block or LRU block as target block */
-    int64_t min_timestamp = get_timestamp();
-    for (int j = 0; j < block_cnt[list_idx]; ++j) {
-        if (this_list[j].timestamp < min_timestamp) {
-            target = &this_list[j];
-            min_timestamp = target->timestamp;
-            if (!min_timestamp) break; /* free block found */
-        }
+
+    pthread_rwlock_wrlock(&shard->lock);
+    cache_entry *fill = chunk_alloc(shard, c);
+    pthread_rwlock_unlock(&shard->lock);
+    if (fill == NULL) {
+        printf("no room to cache\n");
+        return NULL;
     }
-    /* we can write to target block */
-    pthread_rwlock_wrlock(&target->rwlock);
-    memcpy(target->url, url, MAXLINE);
-    memcpy(target->data, data, len);
-    target->datasize = len;
-    target->timestamp = get_timestamp();
-    pthread_rwlock_unlock(&target->rwlock);
+    fill->datasize = 0;
+    fill->hash = hash;
+    fill->hdrlen = -1;
+    fill->until_eof = 1;
+    fill->born = fill->expires = 0;
+    fill->stale_while = fill->stale_error = 0;
+    /* the url sits at the end of the chunk, data grows towards it */
+    fill->url = (char *)fill + class_size[c] - url_len - 1;
+    memcpy(fill->url, url, url_len + 1);
+    return fill;
+}
+
+size_t cache_fill_room(cache_entry *fill) {
+    size_t room = fill->url - fill->data - fill->datasize;
+    size_t left = MAX_OBJECT_SIZE - fill->datasize;
+    return room < left ? room : left;
+}
+
+int cache_fill_append(cache_entry *fill, const char *buf, size_t n) {
+    if (n > cache_fill_room(fill)) return -1;
+    char *tail = fill->data + fill->datasize;
+    /* nothing to copy if the caller read straight into the chunk */
+    if (buf != tail) memcpy(tail, buf, n);
+    fill->datasize += n;
+    return 0;
+}
+
+void cache_fill_commit(cache_entry *fill) {
+    cache_shard *shard = shard_of(fill->hash);
+    size_t url_len = strlen(fill->url);
+    int c = class_of(fill->datasize, url_len);
+    cache_entry *fit = NULL;
+
+    /* begun without a size, move into a chunk that fits. if that class
+     * has no chunk to give, say it has no page and the budget is used up,
+     * a fill alone on its page hands the whole page to it */
+    if (c < fill->cls) {
+        pthread_rwlock_wrlock(&shard->lock);
+        fit = chunk_alloc(shard, c);
+        if (fit == NULL && class_size[fill->cls] > SLAB_PAGE_SIZE / 2)
+            fill = page_shrink(shard, fill, c);
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    if (fit) {
+        fit->datasize = fill->datasize;
+        fit->hash = fill->hash;
+        fit->hdrlen = fill->hdrlen;
+        fit->until_eof = fill->until_eof;
+        fit->born = fill->born;
+        fit->expires = fill->expires;
+        fit->stale_while = fill->stale_while;
+        fit->stale_error = fill->stale_error;
+        memcpy(fit->data, fill->data, fill->datasize);
+        fit->url = (char *)fit + class_size[c] - url_len - 1;
+        memcpy(fit->url, fill->url, url_len + 1);
+    }
+    pthread_rwlock_wrlock(&shard->lock);
+    if (fit) {
+        release_locked(shard, fill);
+        fill = fit;
+    }
+    fill->timestamp = get_timestamp();
+    /* another thread may have cached the same url meanwhile, replace it */
+    cache_entry *old = index_find(shard, fill->url, fill->hash);
+    if (old) {
+        unlink_entry(shard, old);
+        release_locked(shard, old);
+    }
+    link_entry(shard, fill);
+    pthread_rwlock_unlock(&shard->lock);
     printf("write content into cache\n");
 }
 
+void cache_fill_abort(cache_entry *fill) {
+    cache_shard *shard = shard_of(fill->hash);
+    pthread_rwlock_wrlock(&shard->lock);
+    release_locked(shard, fill);
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+void cache_write(char *url, char *data, int len) {
+    time_t now = time(NULL);
+    http_freshness f;
+
+    http_response_freshness(data, len, now, &f);
+    /* a stale response is still worth keeping if it can be revalidated */
+    if (!f.store || (f.lifetime <= f.age && !f.validated)) return;
+    cache_entry *fill = cache_fill_begin(url, len);
+    if (fill == NULL) return;
+    fill->born = now - f.age;
+    fill->expires = fill->born + f.lifetime;
+    cache_fill_append(fill, data, len);
+    cache_fill_commit(fill);
+}
+
+/* find the flight of url and unlink it if unlink is set. caller holds
+ * shard->flight_lock */
+static flight *flight_find(cache_shard *shard, char *url, uint64_t hash,
+                           int unlink) {
+    for (flight **pp = &shard->flights; *pp; pp = &(*pp)->next) {
+        flight *f = *pp;
+        if (f->hash != hash || strcmp(f->url, url)) continue;
+        if (unlink) *pp = f->next;
+        return f;
+    }
+    return NULL;
+}
+
+static void flight_free(flight *f) {
+    pthread_cond_destroy(&f->cond);
+    free(f->url);
+    free(f);
+}
+
+/* start a flight for url and return 1 if there is none, otherwise return 0,
+ * after waiting for it to finish if wait is set */
+static int flight_begin(char *url, int wait) {
+    uint64_t hash = cache_hash(url);
+    cache_shard *shard = shard_of(hash);
+    struct timespec deadline;
+
+    pthread_mutex_lock(&shard->flight_lock);
+    flight *f = flight_find(shard, url, hash, 0);
+    if (f == NULL) {
+        /* we are the first to miss, we fetch */
+        f = (flight *)Malloc(sizeof(flight));
+        f->hash = hash;
+        f->url = strdup(url);
+        f->done = 0;
+        f->waiters = 0;
+        pthread_cond_init(&f->cond, NULL);
+        f->next = shard->flights;
+        shard->flights = f;
+        pthread_mutex_unlock(&shard->flight_lock);
+        return 1;
+    }
+    if (!wait) {
+        pthread_mutex_unlock(&shard->flight_lock);
+        return 0;
+    }
+
+    printf("waiting for another thread fetching %s\n", url);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += FLIGHT_TIMEOUT;
+    f->waiters++;
+    while (!f->done)
+        if (pthread_cond_timedwait(&f->cond, &shard->flight_lock, &deadline))
+            break; /* the endserver is too slow, fetch on our own */
+    /* whoever is the last to leave a finished flight frees it */
+    if (--f->waiters == 0 && f->done) flight_free(f);
+    pthread_mutex_unlock(&shard->flight_lock);
+    return 0;
+}
+
+int cache_flight_begin(char *url) { return flight_begin(url, 1); }
+
+int cache_flight_try(char *url) { return flight_begin(url, 0); }
+
+void cache_flight_end(char *url) {
+    uint64_t hash = cache_hash(url);
+    cache_shard *shard = shard_of(hash);
+
+    pthread_mutex_lock(&shard->flight_lock);
+    flight *f = flight_find(shard, url, hash, 1);
+    if (f) {
+        f->done = 1;
+        pthread_cond_broadcast(&f->cond);
+        if (f->waiters == 0) flight_free(f);
+    }
+    pthread_mutex_unlock(&shard->flight_lock);
+}
+
+void cache_set_clock(int64_t (*clock)(void)) { timestamp_clock = clock; }
+
 int64_t get_timestamp() {
+    if (timestamp_clock) return timestamp_clock();
     struct timeval time;
     gettimeofday(&time, NULL);
     int64_t s1 = (int64_t)(time.tv_sec) * 1000;
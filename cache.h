@@ -3,24 +3,108 @@
 
 #include "csapp.h"
 
-#define LIST_CNT 6
+#define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
+/* default number of independently locked shards */
+#define CACHE_SHARDS 4
+/* the budget is handed out in pages, each page is cut into chunks of one
+ * size class. the largest class takes a whole page */
+#define SLAB_PAGE_SIZE (128 * 1024)
+#define SLAB_MIN_CHUNK 128
+#define SLAB_GROWTH 1.25
+#define SLAB_MAX_CLASSES 64
+/* seconds a miss waits for another thread fetching the same url */
+#define FLIGHT_TIMEOUT 10
 
-typedef struct cache_block {
-    char *url;
-    char *data;
+/* eviction policies: sampled lru, or W-TinyLFU (a small lru window in
+ * front of a segmented lru main region, admitted by a frequency sketch) */
+enum { CACHE_LRU, CACHE_TINYLFU };
+
+/* where a chunk is: free, linked into the index and the lru list of its
+ * class, or neither (being filled, or evicted while a reader pins it) */
+enum { CHUNK_FREE, CHUNK_LINKED, CHUNK_UNLINKED };
+
+/*
+ * a cached object, living in a slab chunk and never modified once it is in
+ * the cache. readers pin it with cache_get, so it stays alive while they
+ * write it out without any lock; eviction only unlinks it, the last
+ * cache_put gives the chunk back to its class
+ */
+typedef struct cache_entry {
+    int refcnt;    /* the cache holds one while it is linked */
     int datasize;
-    int64_t timestamp;
-    pthread_rwlock_t rwlock;
-} cache_block;
+    int cls;       /* slab class of our chunk */
+    int state;     /* CHUNK_FREE, CHUNK_LINKED or CHUNK_UNLINKED */
+    int lru;       /* which lru list of our class we are on */
+    int hit;       /* hit since we were put on that list */
+    uint64_t hash; /* cache_hash(url) */
+    time_t born;    /* when the response was made, by our clock */
+    time_t expires; /* stale from then on, 0 if never */
+    /* set by whoever fills the entry, the cache doesn't look at them */
+    int hdrlen;      /* response headers before their empty line, or -1 */
+    int until_eof;   /* the body ends at EOF, not where the headers say */
+    int stale_while; /* seconds past expires it is served while refreshed */
+    int stale_error; /* seconds past expires it is served if fetching fails */
+    int64_t timestamp;               /* last hit, a hint for eviction */
+    struct cache_entry *prev, *next; /* lru list, or next free chunk */
+    char *url;                       /* at the end of the chunk */
+    char data[];
+} cache_entry;
 
-/* allocate cache memory using calloc */
+/* allocate cache memory lazily, CACHE_SHARDS shards, MAX_CACHE_SIZE and
+ * the CACHE_LRU policy */
 void cache_init();
+/* same as cache_init, with nshards shards sharing a budget of budget bytes
+ * and the given eviction policy. each shard gets an equal share of the
+ * pages, and there are no more shards than pages */
+void cache_init_opt(int nshards, size_t budget, int policy);
 /* free cache's memory */
 void cache_deinit();
-/* try to hit cache block and write content into fd, return 0 if failed */
+/* try to hit a fresh cache block and write content into fd, return 0 if
+ * failed */
 int cache_read(char *url, int fd);
-/* write content into free block or LRU block */
+/* try to hit a fresh cache block and return its entry pinned, NULL if
+ * failed. the entry stays valid until the caller releases it with
+ * cache_put */
+cache_entry *cache_get(char *url);
+/* same as cache_get, but a stale entry is returned too, for revalidation;
+ * the caller checks expires */
+cache_entry *cache_get_stale(char *url);
+/* release an entry returned by cache_get or cache_get_stale */
+void cache_put(cache_entry *entry);
+/* write the response data, status line and headers included, into a free
+ * chunk, evicting old entries if needed. it is kept for as long as its
+ * headers say it is fresh, and not at all if they forbid it */
 void cache_write(char *url, char *data, int len);
-/* return current timestamp */
-int64_t get_timestamp();
\ No newline at end of file
+/*
+ * fill a chunk while the object is relayed instead of staging it first.
+ * begin takes a chunk for size bytes, or for MAX_OBJECT_SIZE if size is -1,
+ * and returns NULL if the object won't be cached; hdrlen and until_eof of
+ * the fill start as -1 and 1, born and expires as 0 (fresh forever) and
+ * the stale windows as 0, the caller sets them. append adds n bytes and
+ * returns -1 if they don't fit; to skip the copy, read at most
+ * cache_fill_room bytes into fill->data + fill->datasize and append them
+ * from there. commit puts the object into the cache, abort drops it
+ */
+cache_entry *cache_fill_begin(char *url, long size);
+size_t cache_fill_room(cache_entry *fill);
+int cache_fill_append(cache_entry *fill, const char *buf, size_t n);
+void cache_fill_commit(cache_entry *fill);
+void cache_fill_abort(cache_entry *fill);
+/* single-flight for misses: return 1 if nobody is fetching url, the caller
+ * then fetches it and must call cache_flight_end. otherwise wait until the
+ * thread fetching it is done (or FLIGHT_TIMEOUT passes) and return 0, the
+ * caller then looks in the cache again */
+int cache_flight_begin(char *url);
+/* same as cache_flight_begin, but return 0 at once if url is being fetched */
+int cache_flight_try(char *url);
+/* done fetching url, successful or not, wake up whoever waits for it */
+void cache_flight_end(char *url);
+/* 64-bit FNV-1a hash of url, the key of the cache index */
+uint64_t cache_hash(const char *url);
+/* return current timestamp, in ms unless cache_set_clock says otherwise */
+int64_t get_timestamp();
+/* take timestamps from clock, or from the wall clock again if it is NULL.
+ * hits within a millisecond tie on the wall clock, so a replay counts its
+ * requests instead to evict the same entries every run */
+void cache_set_clock(int64_t (*clock)(void));
\ No newline at end of file
@@ -0,0 +1,101 @@
+/*
+ * cache_bench.c - throughput of cache.c under threads that look up and
+ * write objects at once, for several thread and shard counts
+ *
+ * usage: cache_bench [maxthreads [ops [writes%]]]
+ *
+ * every thread does ops operations on a set of OBJECTS small objects: a
+ * cache_get and cache_put, or one time in 100/writes% a cache_write of a
+ * new version. the threads double from 1 to maxthreads, for each of
+ * 1, CACHE_SHARDS and 4 * CACHE_SHARDS shards
+ */
+#include "cache.h"
+#include "csapp.h"
+
+#define OBJECTS 1000
+#define OBJECT_SIZE 1024
+#define BUDGET (16 * 1024 * 1024)
+
+static int maxthreads = 8, ops = 200000, writes = 5;
+static char uris[OBJECTS][32];
+static char resp[OBJECT_SIZE];
+static int resp_len;
+
+static void *worker(void *vargp)
+{
+    uint64_t rng = 88172645463325252ULL + (long)vargp;
+
+    for (int i = 0; i < ops; ++i) {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        char *uri = uris[(rng >> 8) % OBJECTS];
+        if ((int)((rng >> 40) % 100) < writes) {
+            cache_write(uri, resp, resp_len);
+        } else {
+            cache_entry *entry = cache_get(uri);
+            if (entry) cache_put(entry);
+        }
+    }
+    return NULL;
+}
+
+/* return operations per second of nthreads over a cache of nshards */
+static double run(int nthreads, int nshards)
+{
+    pthread_t tids[256];
+    struct timespec t0, t1;
+
+    cache_init_opt(nshards, BUDGET, CACHE_LRU);
+    for (int i = 0; i < OBJECTS; ++i) cache_write(uris[i], resp, resp_len);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (long i = 0; i < nthreads; i++)
+        Pthread_create(&tids[i], NULL, worker, (void *)i);
+    for (int i = 0; i < nthreads; i++) Pthread_join(tids[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    cache_deinit();
+    return (double)nthreads * ops /
+           ((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+    int shards[] = {1, CACHE_SHARDS, 4 * CACHE_SHARDS};
+    double rate[3][16];
+    int nrows = 0;
+
+    if (argc > 1) maxthreads = atoi(argv[1]);
+    if (argc > 2) ops = atoi(argv[2]);
+    if (argc > 3) writes = atoi(argv[3]);
+    if (maxthreads < 1 || maxthreads > 256 || ops < 1 || writes < 0 ||
+        writes > 100) {
+        fprintf(stderr, "usage: %s [maxthreads [ops [writes%%]]]\n",
+                argv[0]);
+        exit(1);
+    }
+
+    for (int i = 0; i < OBJECTS; ++i) sprintf(uris[i], "http://b/%d", i);
+    resp_len = sprintf(resp, "HTTP/1.0 200 OK\r\n"
+                             "Cache-Control: max-age=86400\r\n"
+                             "Content-Length: %d\r\n\r\n",
+                       OBJECT_SIZE / 2);
+    memset(resp + resp_len, 'x', OBJECT_SIZE / 2);
+    resp_len += OBJECT_SIZE / 2;
+
+    /* cache.c reports every hit and miss on stdout */
+    int devnull = open("/dev/null", O_WRONLY), saved = dup(1);
+    fflush(stdout);
+    dup2(devnull, 1);
+    for (int t = 1; t <= maxthreads; t *= 2, ++nrows)
+        for (int s = 0; s < 3; ++s) rate[s][nrows] = run(t, shards[s]);
+    fflush(stdout);
+    dup2(saved, 1);
+
+    printf("%d ops per thread, %d%% writes, operations/s:\n", ops, writes);
+    printf("threads %12d shard %10d shards %10d shards\n", shards[0],
+           shards[1], shards[2]);
+    for (int t = 1, r = 0; r < nrows; t *= 2, ++r)
+        printf("%7d %18.0f %17.0f %17.0f\n", t, rate[0][r], rate[1][r],
+               rate[2][r]);
+    return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * cache_replay.c - hit ratio of the LRU and W-TinyLFU policies of cache.c
+ * on a request trace
+ *
+ * usage: cache_replay [-m bytes] [-s nshards] <trace>
+ *        cache_replay -g <objects> <requests> <scan> <minsize> <maxsize>
+ *
+ * a trace has a line "<uri> <size>" per request. the first form replays
+ * it through cache_get and cache_write, once with each policy, a miss
+ * writing a cacheable response of size bytes. the cache's clock counts
+ * requests, so a trace gives the same hits every run. the second form
+ * prints a trace: Zipf requests over objects, with scan uris that are
+ * asked for only once slipped in after every 1000 requests, sizes uniform
+ * in [minsize, maxsize]
+ */
+#include "cache.h"
+#include "csapp.h"
+
+#define ZIPF_S 0.99 /* skew of the popularity of objects */
+#define SCAN_EVERY 1000
+
+typedef struct {
+    char *uri;
+    int size;
+} request;
+
+static uint64_t rng = 88172645463325252ULL;
+static int64_t now; /* requests replayed, the clock of the cache */
+
+static uint64_t next_rand(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+/* the size of object id, the same every time it is asked for */
+static int object_size(long id, int minsize, int maxsize)
+{
+    uint64_t h = (uint64_t)id * 0x9e3779b97f4a7c15ULL;
+    return minsize + (int)((h >> 33) % (uint64_t)(maxsize - minsize + 1));
+}
+
+static void generate(long objects, long requests, long scan, int minsize,
+                     int maxsize)
+{
+    double *cdf = Malloc(objects * sizeof(double)), sum = 0;
+    long scanned = 0;
+
+    for (long i = 0; i < objects; ++i) cdf[i] = sum += pow(i + 1, -ZIPF_S);
+    for (long r = 0; r < requests; ++r) {
+        double u = (next_rand() >> 11) * (1.0 / 9007199254740992.0) * sum;
+        long lo = 0, hi = objects - 1;
+        while (lo < hi) {
+            long mid = (lo + hi) / 2;
+            if (cdf[mid] < u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        printf("http://z/%ld %d\n", lo, object_size(lo, minsize, maxsize));
+        if ((r + 1) % SCAN_EVERY) continue;
+        for (long i = 0; i < scan; ++i, ++scanned)
+            printf("http://s/%ld %d\n", scanned,
+                   object_size(objects + scanned, minsize, maxsize));
+    }
+    Free(cdf);
+}
+
+static int64_t replay_clock(void)
+{
+    return now;
+}
+
+static request *load(char *path, long *n)
+{
+    FILE *fp = fopen(path, "r");
+    char uri[MAXLINE];
+    long cap = 1024;
+    int size;
+    request *reqs = Malloc(cap * sizeof(request));
+
+    if (fp == NULL) unix_error("cannot open trace");
+    for (*n = 0; fscanf(fp, "%8191s %d", uri, &size) == 2; ++*n) {
+        if (*n == cap) reqs = Realloc(reqs, (cap *= 2) * sizeof(request));
+        reqs[*n].uri = strdup(uri);
+        reqs[*n].size = size;
+    }
+    fclose(fp);
+    return reqs;
+}
+
+/* replay reqs with a fresh cache, return the hits */
+static long replay(request *reqs, long n, int nshards, size_t budget,
+                   int policy)
+{
+    char *resp = Malloc(MAX_OBJECT_SIZE + MAXLINE);
+    int devnull = open("/dev/null", O_WRONLY), saved = dup(1);
+    long hits = 0;
+
+    /* cache.c reports every hit and miss on stdout */
+    fflush(stdout);
+    dup2(devnull, 1);
+    cache_init_opt(nshards, budget, policy);
+    cache_set_clock(replay_clock);
+    memset(resp, 'x', MAX_OBJECT_SIZE + MAXLINE);
+    for (long i = 0; i < n; ++i) {
+        now = i;
+        cache_entry *entry = cache_get(reqs[i].uri);
+        if (entry) {
+            ++hits;
+            cache_put(entry);
+            continue;
+        }
+        int len = sprintf(resp,
+                          "HTTP/1.0 200 OK\r\nCache-Control: max-age=86400"
+                          "\r\nContent-Length: %d\r\n\r\n",
+                          reqs[i].size);
+        resp[len] = 'x'; /* sprintf's NUL */
+        len += reqs[i].size;
+        if (len <= MAX_OBJECT_SIZE) cache_write(reqs[i].uri, resp, len);
+    }
+    cache_deinit();
+    cache_set_clock(NULL);
+    fflush(stdout);
+    dup2(saved, 1);
+    close(saved);
+    close(devnull);
+    Free(resp);
+    return hits;
+}
+
+int main(int argc, char **argv)
+{
+    size_t budget = MAX_CACHE_SIZE;
+    int nshards = 1, opt;
+    long n;
+
+    if (argc == 7 && !strcmp(argv[1], "-g")) {
+        int minsize = atoi(argv[5]), maxsize = atoi(argv[6]);
+        if (atol(argv[2]) < 1 || minsize < 1 || maxsize < minsize) {
+            fprintf(stderr, "bad trace parameters\n");
+            exit(1);
+        }
+        generate(atol(argv[2]), atol(argv[3]), atol(argv[4]), minsize,
+                 maxsize);
+        return 0;
+    }
+    while ((opt = getopt(argc, argv, "m:s:")) != -1) {
+        if (opt == 'm')
+            budget = strtoul(optarg, NULL, 10);
+        else if (opt == 's')
+            nshards = atoi(optarg);
+        else
+            break;
+    }
+    if (optind != argc - 1 || nshards < 1) {
+        fprintf(stderr,
+                "usage: %s [-m bytes] [-s nshards] <trace>\n"
+                "       %s -g <objects> <requests> <scan> <minsize> "
+                "<maxsize>\n",
+                argv[0], argv[0]);
+        exit(1);
+    }
+
+    request *reqs = load(argv[optind], &n);
+    if (n == 0) app_error("empty trace");
+    printf("%ld requests, %zu bytes of cache, %d shards\n", n, budget,
+           nshards);
+    long lru = replay(reqs, n, nshards, budget, CACHE_LRU);
+    printf("lru:       %ld hits, %.1f%%\n", lru, 100.0 * lru / n);
+    long tinylfu = replay(reqs, n, nshards, budget, CACHE_TINYLFU);
+    printf("w-tinylfu: %ld hits, %.1f%%\n", tinylfu, 100.0 * tinylfu / n);
+    for (long i = 0; i < n; ++i) free(reqs[i].uri);
+    Free(reqs);
+    return 0;
+}
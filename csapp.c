@@ -893,6 +893,29 @@ ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_readblockb - Read one block (buffered): the bytes rp has read ahead
+ *     if there are any, otherwise whatever a single read() returns. Unlike
+ *     rio_readnb it never waits for n bytes, so a relay can pass each
+ *     block on as soon as it arrives
+ */
+ssize_t rio_readblockb(rio_t *rp, void *usrbuf, size_t n)
+{
+    ssize_t rc;
+
+    if (rp->rio_cnt > 0) {
+        if (n > rp->rio_cnt)
+            n = rp->rio_cnt;
+        memcpy(usrbuf, rp->rio_bufptr, n);
+        rp->rio_bufptr += n;
+        rp->rio_cnt -= n;
+        return n;
+    }
+    while ((rc = read(rp->rio_fd, usrbuf, n)) < 0 && errno == EINTR)
+        ; /* Interrupted by sig handler return */
+    return rc;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -995,6 +1018,18 @@ int open_clientfd(char *hostname, char *port) {
  */
 /* $begin open_listenfd */
 int open_listenfd(char *port) 
+{
+    return open_listenfd_opt(port, 0);
+}
+/* $end open_listenfd */
+
+/*
+ * open_listenfd_opt - Same as open_listenfd, but if reuseport is nonzero
+ *     the socket also sets SO_REUSEPORT, so several sockets (one per
+ *     thread) can listen on the same port and the kernel balances new
+ *     connections among them.
+ */
+int open_listenfd_opt(char *port, int reuseport) 
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
@@ -1018,6 +1053,11 @@ int open_listenfd(char *port)
         /* Eliminates "Address already in use" error from bind */
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
                    (const void *)&optval , sizeof(int));
+        if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                    (const void *)&optval, sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
 
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
@@ -1041,7 +1081,6 @@ int open_listenfd(char *port)
     }
     return listenfd;
 }
-/* $end open_listenfd */
 
 /****************************************************
  * Wrappers for reentrant protocol-independent helpers
@@ -1064,6 +1103,15 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_listenfd_opt(char *port, int reuseport) 
+{
+    int rc;
+
+    if ((rc = open_listenfd_opt(port, reuseport)) < 0)
+	unix_error("Open_listenfd_opt error");
+    return rc;
+}
+
 /* $end csapp.c */
 
 
@@ -0,0 +1,247 @@
+/*
+ * dns.c - asynchronous name resolution with a TTL cache
+ *
+ * getaddrinfo blocks, for seconds when the resolver is slow, and most
+ * requests go to a handful of hosts. So answers are cached, failures too
+ * for a shorter while, and lookups run on a few resolver threads: a worker
+ * asking for a name that is being resolved waits for that lookup instead of
+ * starting its own, and gives up after DNS_TIMEOUT seconds even if the
+ * resolver doesn't. getaddrinfo doesn't tell the TTL of its records, so
+ * every answer is kept for DNS_TTL seconds. Event loops cannot wait at
+ * all: dns_lookup_start hands them the answer later through an eventfd.
+ */
+#include "dns.h"
+
+#include <sys/eventfd.h>
+
+#include "csapp.h"
+
+typedef struct dns_entry {
+    int resolving; /* queued or being resolved */
+    int waiters;   /* callers waiting for it */
+    dns_query *queries; /* event loops waiting for it */
+    int err;       /* 0 or the EAI_ code of the last lookup */
+    time_t expires;
+    dns_addrs addrs;
+    struct dns_entry *next;     /* next in the bucket */
+    struct dns_entry *next_job; /* next in the resolver queue */
+    char *port;                 /* in key, after the host */
+    char key[];
+} dns_entry;
+
+static struct {
+    dns_entry *head;
+    pthread_mutex_t lock;
+    pthread_cond_t done; /* a lookup of this bucket finished */
+} buckets[DNS_BUCKETS] = {[0 ... DNS_BUCKETS - 1] = {
+                              NULL, PTHREAD_MUTEX_INITIALIZER,
+                              PTHREAD_COND_INITIALIZER}};
+
+/* names waiting for a resolver thread, oldest first */
+static struct {
+    dns_entry *head, *tail;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} jobs = {NULL, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static pthread_once_t started = PTHREAD_ONCE_INIT;
+
+static unsigned bucket_of(const char *host, const char *port) {
+    unsigned h = 2166136261u; /* FNV-1a */
+    for (; *host; ++host) h = (h ^ (unsigned char)*host) * 16777619u;
+    for (; *port; ++port) h = (h ^ (unsigned char)*port) * 16777619u;
+    return h % DNS_BUCKETS;
+}
+
+/* put a finished query on the done list of its event loop and wake it */
+static void notify(dns_query *q) {
+    dns_notify *n = q->notify;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&n->lock);
+    q->next = n->done;
+    n->done = q;
+    pthread_mutex_unlock(&n->lock);
+    if (write(n->fd, &one, sizeof(one)) < 0) unix_error("eventfd write error");
+}
+
+static void resolve(dns_entry *e) {
+    struct addrinfo hints, *listp, *p;
+    dns_addrs addrs = {0};
+    unsigned b = bucket_of(e->key, e->port);
+    int rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if ((rc = getaddrinfo(e->key, e->port, &hints, &listp)) == 0) {
+        for (p = listp; p && addrs.n < DNS_MAX_ADDRS; p = p->ai_next) {
+            memcpy(&addrs.addr[addrs.n], p->ai_addr, p->ai_addrlen);
+            addrs.len[addrs.n++] = p->ai_addrlen;
+        }
+        freeaddrinfo(listp);
+    }
+
+    pthread_mutex_lock(&buckets[b].lock);
+    /* while the resolver is unreachable the old answer beats none */
+    e->err = rc == EAI_AGAIN && e->addrs.n > 0 ? 0 : rc;
+    if (rc == 0) e->addrs = addrs;
+    e->expires = time(NULL) + (rc == 0 ? DNS_TTL : DNS_NEG_TTL);
+    e->resolving = 0;
+    pthread_cond_broadcast(&buckets[b].done);
+    while (e->queries) {
+        dns_query *q = e->queries;
+        e->queries = q->next;
+        q->err = e->err;
+        q->addrs = e->addrs;
+        notify(q);
+    }
+    pthread_mutex_unlock(&buckets[b].lock);
+}
+
+static void *resolver(void *vargp) {
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&jobs.lock);
+        while (!jobs.head) pthread_cond_wait(&jobs.ready, &jobs.lock);
+        dns_entry *e = jobs.head;
+        if (!(jobs.head = e->next_job)) jobs.tail = NULL;
+        pthread_mutex_unlock(&jobs.lock);
+        resolve(e);
+    }
+    return NULL;
+}
+
+static void start_resolvers(void) {
+    pthread_t tid;
+    for (int i = 0; i < DNS_THREADS; ++i)
+        Pthread_create(&tid, NULL, resolver, NULL);
+}
+
+static void enqueue(dns_entry *e) {
+    e->resolving = 1;
+    e->next_job = NULL;
+    pthread_mutex_lock(&jobs.lock);
+    if (jobs.tail)
+        jobs.tail->next_job = e;
+    else
+        jobs.head = e;
+    jobs.tail = e;
+    pthread_cond_signal(&jobs.ready);
+    pthread_mutex_unlock(&jobs.lock);
+}
+
+/*
+ * the entry of host:port in bucket b, whose lock the caller holds, queued
+ * for resolving if it is new or expired. entries nobody asked for in a
+ * while are unlinked onto *dead, to be freed after unlocking
+ */
+static dns_entry *find_entry(const char *host, const char *port, unsigned b,
+                             time_t now, dns_entry **dead) {
+    dns_entry *e, **pp;
+
+    for (pp = &buckets[b].head; (e = *pp) != NULL;) {
+        if (!strcmp(e->key, host) && !strcmp(e->port, port)) break;
+        if (!e->resolving && !e->waiters && now - e->expires > DNS_TTL) {
+            *pp = e->next;
+            e->next = *dead;
+            *dead = e;
+        } else {
+            pp = &e->next;
+        }
+    }
+    if (!e) {
+        size_t hlen = strlen(host) + 1;
+        e = Calloc(1, sizeof(dns_entry) + hlen + strlen(port) + 1);
+        strcpy(e->key, host);
+        e->port = e->key + hlen;
+        strcpy(e->port, port);
+        e->next = buckets[b].head;
+        buckets[b].head = e;
+        enqueue(e);
+    } else if (!e->resolving && now >= e->expires) {
+        enqueue(e);
+    }
+    return e;
+}
+
+static void free_dead(dns_entry *dead) {
+    while (dead) {
+        dns_entry *e = dead->next;
+        free(dead);
+        dead = e;
+    }
+}
+
+int dns_lookup(const char *host, const char *port, dns_addrs *out) {
+    unsigned b = bucket_of(host, port);
+    time_t now = time(NULL);
+    dns_entry *e, *dead = NULL;
+    struct timespec deadline = {now + DNS_TIMEOUT, 0};
+    int rc;
+
+    pthread_once(&started, start_resolvers);
+    pthread_mutex_lock(&buckets[b].lock);
+    e = find_entry(host, port, b, now, &dead);
+    e->waiters++;
+    while (e->resolving &&
+           pthread_cond_timedwait(&buckets[b].done, &buckets[b].lock,
+                                  &deadline) != ETIMEDOUT)
+        ;
+    e->waiters--;
+    /* the first lookup of a name has nothing to fall back on */
+    if (e->resolving && e->expires == 0) {
+        rc = EAI_AGAIN;
+    } else {
+        rc = e->err;
+        *out = e->addrs;
+    }
+    pthread_mutex_unlock(&buckets[b].lock);
+    free_dead(dead);
+    return rc;
+}
+
+int dns_notify_init(dns_notify *n) {
+    n->done = NULL;
+    pthread_mutex_init(&n->lock, NULL);
+    n->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return n->fd < 0 ? -1 : 0;
+}
+
+int dns_lookup_start(const char *host, const char *port, dns_query *q,
+                     dns_notify *n) {
+    unsigned b = bucket_of(host, port);
+    dns_entry *e, *dead = NULL;
+    int answered = 0;
+
+    pthread_once(&started, start_resolvers);
+    pthread_mutex_lock(&buckets[b].lock);
+    e = find_entry(host, port, b, time(NULL), &dead);
+    /* only the first lookup of a name has nothing to go on */
+    if (e->expires) {
+        answered = 1;
+        q->err = e->err;
+        q->addrs = e->addrs;
+    } else {
+        q->notify = n;
+        q->next = e->queries;
+        e->queries = q;
+    }
+    pthread_mutex_unlock(&buckets[b].lock);
+    free_dead(dead);
+    return answered;
+}
+
+dns_query *dns_notify_take(dns_notify *n) {
+    uint64_t cnt;
+    dns_query *done;
+
+    /* reset the eventfd before taking, a later notify sets it again */
+    if (read(n->fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+        unix_error("eventfd read error");
+    pthread_mutex_lock(&n->lock);
+    done = n->done;
+    n->done = NULL;
+    pthread_mutex_unlock(&n->lock);
+    return done;
+}
@@ -0,0 +1,62 @@
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define DNS_THREADS 4    /* resolver threads */
+#define DNS_TTL 60       /* seconds a resolved name is trusted */
+#define DNS_NEG_TTL 5    /* seconds a failed one is */
+#define DNS_TIMEOUT 5    /* seconds a caller waits for a lookup */
+#define DNS_BUCKETS 64
+#define DNS_MAX_ADDRS 8
+
+/* the addresses of a name, in the order getaddrinfo gave them */
+typedef struct {
+    int n;
+    struct sockaddr_storage addr[DNS_MAX_ADDRS];
+    socklen_t len[DNS_MAX_ADDRS];
+} dns_addrs;
+
+/*
+ * resolve host and a numeric port into out. answers, failures included,
+ * come from the cache while they are fresh; otherwise the lookup is handed
+ * to the resolver threads, shared with whoever asks for the same name
+ * meanwhile. return 0, or the EAI_ code of the failure, EAI_AGAIN if no
+ * answer came within DNS_TIMEOUT seconds
+ */
+int dns_lookup(const char *host, const char *port, dns_addrs *out);
+
+/* where the finished lookups of one event loop go */
+typedef struct dns_notify {
+    int fd;                  /* eventfd, readable while done is not empty */
+    struct dns_query *done;  /* guarded by lock */
+    pthread_mutex_t lock;
+} dns_notify;
+
+/* a lookup that an event loop does not wait for */
+typedef struct dns_query {
+    int err;                 /* 0 or the EAI_ code, once it finished */
+    dns_addrs addrs;
+    void *arg;               /* the caller's, e.g. its connection */
+    dns_notify *notify;
+    struct dns_query *next;  /* on the name being resolved, then on done */
+} dns_query;
+
+/* create the eventfd of n, return -1 with errno set */
+int dns_notify_init(dns_notify *n);
+/*
+ * like dns_lookup, but never blocks. return 1 if the cache answered into
+ * q at once, q->err tells whether the name resolved; a name with an
+ * expired answer gets that answer while it is refreshed. otherwise return
+ * 0: the resolver threads put q on n's done list when they are through,
+ * and make n->fd readable. EAI_ codes are negative in glibc, so they can't
+ * tell the two apart
+ */
+int dns_lookup_start(const char *host, const char *port, dns_query *q,
+                     dns_notify *n);
+/* take every finished query off n's done list, after n->fd was readable */
+dns_query *dns_notify_take(dns_notify *n);
+
+#endif /* __DNS_H__ */
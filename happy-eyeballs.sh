@@ -0,0 +1,92 @@
+#!/bin/bash
+#
+# happy-eyeballs.sh - checks that proxy gets past an endserver address
+#     that drops SYNs. The first address of <host> gets a listener
+#     whose backlog is full, so connects to it hang; the first address of
+#     the other family gets a working web server. A request through proxy
+#     must be answered by the second well before the kernel's SYN timeout.
+#
+#     usage: ./happy-eyeballs.sh [host]
+#
+#     host (default localhost) must resolve to an IPv6 and an IPv4
+#     address, e.g. with "::1 localhost" in /etc/hosts; otherwise the
+#     test is skipped.
+#
+
+HOST=${1:-localhost}
+TIMEOUT=30   # seconds curl waits
+MAX_TIME=2   # seconds the request may take
+
+if [ ! -x ./proxy ]; then
+    echo "Error: ./proxy not found, run make first"
+    exit 1
+fi
+
+# the addresses in the order getaddrinfo returns them
+addrs=$(getent ahosts ${HOST} | awk '$2 == "STREAM" {print $1}')
+first=$(echo "${addrs}" | head -1)
+if [[ ${first} == *:* ]]; then
+    second=$(echo "${addrs}" | grep -v : | head -1)
+else
+    second=$(echo "${addrs}" | grep : | head -1)
+fi
+if [ -z "${first}" ] || [ -z "${second}" ]; then
+    echo "Skipped: ${HOST} needs both an IPv6 and an IPv4 address"
+    exit 0
+fi
+
+port=$(bash ./free-port.sh)
+proxy_port=$((port + 1))
+while netstat -tln 2>/dev/null | grep -q ":${proxy_port} "; do
+    proxy_port=$((proxy_port + 1))
+done
+
+# drop SYNs on the first address: a listener that never accepts, its
+# backlog filled by connections of our own
+python3 - ${first} ${port} <<'EOF' &
+import socket, sys, time
+addr, port = sys.argv[1], int(sys.argv[2])
+family = socket.AF_INET6 if ':' in addr else socket.AF_INET
+l = socket.socket(family)
+l.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+l.bind((addr, port))
+l.listen(0)
+held = []
+for i in range(8):
+    c = socket.socket(family)
+    c.setblocking(False)
+    try:
+        c.connect((addr, port))
+    except BlockingIOError:
+        pass
+    held.append(c)
+time.sleep(3600)
+EOF
+hole_pid=$!
+
+# serve this directory on the other one
+python3 -m http.server --bind ${second} ${port} >/dev/null 2>&1 &
+server_pid=$!
+
+./proxy ${proxy_port} >/dev/null 2>&1 &
+proxy_pid=$!
+sleep 1
+
+echo "${HOST}: ${first} drops SYNs, ${second} answers"
+result=$(curl --silent --output /dev/null --max-time ${TIMEOUT} \
+    --write-out "%{http_code} %{time_total}" \
+    --proxy http://localhost:${proxy_port} \
+    http://${HOST}:${port}/happy-eyeballs.sh)
+
+kill ${proxy_pid} ${server_pid} ${hole_pid} 2>/dev/null
+wait 2>/dev/null
+
+code=${result% *}
+secs=${result#* }
+echo "status ${code} after ${secs} s"
+if [ "${code}" != "200" ] || awk "BEGIN {exit !(${secs} > ${MAX_TIME})}"; then
+    echo "Failed: expected 200 within ${MAX_TIME} s"
+    exit 1
+fi
+echo "Passed"
+exit 0
@@ -0,0 +1,716 @@
+/*
+ * http_parse.c - zero-copy parser of HTTP request headers
+ *
+ * Instead of reading and comparing one line (and one byte) at a time, we
+ * take the whole header block and hunt for the delimiters (\n, ':' and
+ * ' ') 16 or 32 bytes at a time with SSE2/AVX2. The result only holds
+ * views into the receive buffer. Build with -DHTTP_PARSE_SCALAR to force
+ * the plain C version.
+ */
+#include "http_parse.h"
+
+#include <limits.h>
+
+#include "csapp.h"
+
+#if (defined(__x86_64__) || defined(__SSE2__)) && !defined(HTTP_PARSE_SCALAR)
+#include <immintrin.h>
+#define HAVE_SSE2
+#endif
+
+/*
+ * well-known header names sit in a perfect hash on (length, first and last
+ * letter). if you add a name, pick HDR_HASH_A/B and HDR_TABLE_SIZE again so
+ * no two names share a slot
+ */
+#define HDR_TABLE_SIZE 8
+#define HDR_HASH_A 1
+#define HDR_HASH_B 3
+#define HDR_HASH(len, first, last)                                     \
+    (((len)*HDR_HASH_A + ((first) | 0x20) + ((last) | 0x20) * HDR_HASH_B) & \
+     (HDR_TABLE_SIZE - 1))
+
+static const struct {
+    const char *name;
+    size_t len;
+    int id;
+} hdr_table[HDR_TABLE_SIZE] = {
+    [0] = {"Host", 4, HDR_HOST},
+    [2] = {"Proxy-Connection", 16, HDR_PROXY_CONNECTION},
+    [3] = {"User-Agent", 10, HDR_USER_AGENT},
+    [7] = {"Connection", 10, HDR_CONNECTION},
+};
+
+/* return the first byte in [p, end) equal to a or b, or end if none */
+static const char *find2_scalar(const char *p, const char *end, char a,
+                                char b) {
+    for (; p < end; ++p)
+        if (*p == a || *p == b) return p;
+    return end;
+}
+
+#ifdef HAVE_SSE2
+static const char *find2_sse2(const char *p, const char *end, char a,
+                              char b) {
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return find2_scalar(p, end, a, b);
+}
+
+__attribute__((target("avx2"))) static const char *find2_avx2(
+    const char *p, const char *end, char a, char b) {
+    const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return find2_sse2(p, end, a, b);
+}
+#endif
+
+static const char *(*find2)(const char *, const char *, char,
+                            char) = find2_scalar;
+
+/* pick the widest version this CPU runs, once at startup */
+__attribute__((constructor)) static void find2_init() {
+#ifdef HAVE_SSE2
+    __builtin_cpu_init();
+    find2 = __builtin_cpu_supports("avx2") ? find2_avx2 : find2_sse2;
+#endif
+}
+
+size_t http_find_end(const char *buf, size_t n) {
+    const char *p = buf, *end = buf + n;
+
+    /* the block ends at the first line that is empty, "\r\n" or "\n" */
+    while ((p = find2(p, end, '\n', '\n')) < end) {
+        ++p;
+        if (p < end && *p == '\n') return p + 1 - buf;
+        if (p + 1 < end && p[0] == '\r' && p[1] == '\n') return p + 2 - buf;
+    }
+    return 0;
+}
+
+int http_header_id(const char *name, size_t len) {
+    if (len == 0) return HDR_OTHER;
+    int h = HDR_HASH(len, name[0], name[len - 1]);
+    if (hdr_table[h].len == len && !strncasecmp(hdr_table[h].name, name, len))
+        return hdr_table[h].id;
+    return HDR_OTHER;
+}
+
+/* end of a view that stopped at \n, without the \r before it */
+static const char *trim_cr(const char *p, const char *eol) {
+    return (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+}
+
+int http_parse_request(const char *buf, size_t n, http_request *req) {
+    const char *p = buf, *end = buf + n, *q, *eol;
+
+    /* request line: method SP uri SP version CRLF */
+    if ((eol = find2(p, end, '\n', '\n')) == end) return -1;
+    if ((q = find2(p, eol, ' ', ' ')) == eol || q == p) return -1;
+    req->method.p = p;
+    req->method.len = q - p;
+    p = q + 1;
+    if ((q = find2(p, eol, ' ', ' ')) == eol || q == p) return -1;
+    req->uri.p = p;
+    req->uri.len = q - p;
+    p = q + 1;
+    req->version.p = p;
+    req->version.len = trim_cr(p, eol) - p;
+    if (req->version.len == 0) return -1;
+
+    /* headers: name ':' OWS value OWS CRLF, up to an empty line */
+    req->nhdrs = 0;
+    for (p = eol + 1; p < end; p = eol + 1) {
+        if ((q = find2(p, end, ':', '\n')) == end) return -1;
+        if (*q == '\n') /* the empty line, or a line without colon */
+            return trim_cr(p, q) == p ? 0 : -1;
+        if (q == p || req->nhdrs == HTTP_MAX_HDRS) return -1;
+        if ((eol = find2(q, end, '\n', '\n')) == end) return -1;
+
+        http_header *h = &req->hdrs[req->nhdrs++];
+        h->name.p = p;
+        h->name.len = q - p;
+        h->line.p = p;
+        h->line.len = eol + 1 - p;
+        for (++q; q < eol && (*q == ' ' || *q == '\t'); ++q)
+            ;
+        const char *v = eol;
+        while (v > q && (v[-1] == '\r' || v[-1] == ' ' || v[-1] == '\t')) --v;
+        h->value.p = q;
+        h->value.len = v - q;
+        h->id = http_header_id(h->name.p, h->name.len);
+    }
+    return -1; /* no empty line */
+}
+
+ssize_t http_read_headers(rio_t *rp, char *buf, size_t maxlen) {
+    size_t len = 0, end;
+
+    while (1) {
+        if (rp->rio_cnt <= 0) {
+            /* refill rio ourselves, what we read past the headers stays in
+             * rio for whoever reads next */
+            ssize_t rc = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+            if (rc < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            if (rc == 0) return 0; /* EOF */
+            rp->rio_cnt = rc;
+            rp->rio_bufptr = rp->rio_buf;
+        }
+        size_t n = rp->rio_cnt;
+        if (n > maxlen - 1 - len) n = maxlen - 1 - len;
+        if (n == 0) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        memcpy(buf + len, rp->rio_bufptr, n);
+
+        /* the empty line may straddle the last chunk, look a bit back */
+        size_t from = len > 3 ? len - 3 : 0;
+        len += n;
+        if ((end = http_find_end(buf + from, len - from)) != 0) {
+            end += from;
+            n -= len - end; /* only take up to the end of block from rio */
+            len = end;
+        }
+        rp->rio_bufptr += n;
+        rp->rio_cnt -= n;
+        if (end) {
+            buf[len] = '\0';
+            return len;
+        }
+    }
+}
+
+int http_has_token(const char *list, size_t len, const char *token) {
+    const char *p = list, *end = list + len, *q;
+    size_t tlen = strlen(token);
+
+    for (; p < end; p = q + 1) {
+        const char *e = q = find2(p, end, ',', ',');
+        while (p < e && (*p == ' ' || *p == '\t')) ++p;
+        while (e > p && (e[-1] == ' ' || e[-1] == '\t')) --e;
+        if ((size_t)(e - p) == tlen && !strncasecmp(p, token, tlen)) return 1;
+    }
+    return 0;
+}
+
+/* states of http_chunked: a chunk-size line (maybe with extensions), its
+ * data and the CRLF after it, then trailer lines up to an empty one */
+enum {
+    CH_SIZE = 0,
+    CH_SIZE_EXT,
+    CH_SIZE_LF,
+    CH_DATA,
+    CH_DATA_CR,
+    CH_DATA_LF,
+    CH_TRAILER_START,
+    CH_TRAILER,
+    CH_END_LF,
+    CH_DONE,
+};
+
+static int hex_digit(char ch) {
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    ch |= 0x20;
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    return -1;
+}
+
+/* follow the framing over buf[0..n) as http_chunked_feed does, and copy
+ * the data of the chunks to out if it is not NULL, *outlen bytes of it */
+static ssize_t chunked_run(http_chunked *c, const char *buf, size_t n,
+                           int *done, char *out, size_t *outlen) {
+    size_t i = 0;
+    int d;
+
+    while (i < n && c->state != CH_DONE) {
+        char ch = buf[i];
+        switch (c->state) {
+        case CH_SIZE:
+            if ((d = hex_digit(ch)) >= 0) {
+                if (c->left >> 60) return -1; /* absurd chunk size */
+                c->left = c->left * 16 + d;
+                break;
+            }
+            if (ch == ';' || ch == ' ' || ch == '\t')
+                c->state = CH_SIZE_EXT;
+            else if (ch == '\r')
+                c->state = CH_SIZE_LF;
+            else if (ch == '\n')
+                c->state = c->left ? CH_DATA : CH_TRAILER_START;
+            else
+                return -1;
+            break;
+        case CH_SIZE_EXT:
+            if (ch == '\n') c->state = c->left ? CH_DATA : CH_TRAILER_START;
+            break;
+        case CH_SIZE_LF:
+            if (ch != '\n') return -1;
+            c->state = c->left ? CH_DATA : CH_TRAILER_START;
+            break;
+        case CH_DATA: {
+            /* skip over the data in one step */
+            size_t k = n - i < c->left ? n - i : c->left;
+            if (out) {
+                memmove(out + *outlen, buf + i, k);
+                *outlen += k;
+            }
+            c->left -= k;
+            i += k;
+            if (c->left == 0) c->state = CH_DATA_CR;
+            continue;
+        }
+        case CH_DATA_CR:
+            if (ch == '\r')
+                c->state = CH_DATA_LF;
+            else if (ch == '\n')
+                c->state = CH_SIZE;
+            else
+                return -1;
+            break;
+        case CH_DATA_LF:
+            if (ch != '\n') return -1;
+            c->state = CH_SIZE;
+            break;
+        case CH_TRAILER_START:
+            if (ch == '\r')
+                c->state = CH_END_LF;
+            else if (ch == '\n')
+                c->state = CH_DONE;
+            else
+                c->state = CH_TRAILER;
+            break;
+        case CH_TRAILER:
+            if (ch == '\n') c->state = CH_TRAILER_START;
+            break;
+        case CH_END_LF:
+            if (ch != '\n') return -1;
+            c->state = CH_DONE;
+            break;
+        }
+        ++i;
+    }
+    *done = c->state == CH_DONE;
+    return i;
+}
+
+ssize_t http_chunked_feed(http_chunked *c, const char *buf, size_t n,
+                          int *done) {
+    return chunked_run(c, buf, n, done, NULL, NULL);
+}
+
+ssize_t http_chunked_decode(http_chunked *c, const char *buf, size_t n,
+                            char *out, int *done) {
+    size_t len = 0;
+
+    if (chunked_run(c, buf, n, done, out, &len) < 0) return -1;
+    return len;
+}
+
+time_t http_parse_date(const char *s, size_t len) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char buf[64], mon[4] = "";
+    struct tm tm = {0};
+    int year, n = 0;
+    const char *m;
+
+    if (len >= sizeof(buf)) return -1;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    /* Sun, 06 Nov 1994 08:49:37 GMT, Sunday, 06-Nov-94 08:49:37 GMT and
+     * Sun Nov  6 08:49:37 1994 */
+    if (sscanf(buf, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT%n", &tm.tm_mday, mon,
+               &year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &n) == 6 &&
+        n) {
+    } else if (sscanf(buf, "%*[A-Za-z], %2d-%3s-%2d %2d:%2d:%2d GMT%n",
+                      &tm.tm_mday, mon, &year, &tm.tm_hour, &tm.tm_min,
+                      &tm.tm_sec, &n) == 6 &&
+               n) {
+        year += year < 70 ? 2000 : 1900;
+    } else if (sscanf(buf, "%*3s %3s %2d %2d:%2d:%2d %4d%n", mon,
+                      &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec,
+                      &year, &n) != 6 ||
+               !n) {
+        return -1;
+    }
+    if (strlen(mon) != 3 || !(m = strstr(months, mon)) ||
+        (m - months) % 3 || tm.tm_mday < 1 || tm.tm_mday > 31 ||
+        tm.tm_hour > 23 || tm.tm_min > 59 || tm.tm_sec > 60)
+        return -1;
+    tm.tm_mon = (m - months) / 3;
+    tm.tm_year = year - 1900;
+    return timegm(&tm);
+}
+
+/* a header value without the whitespace and line end around it */
+static http_str trim(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t')) ++p;
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' ||
+                       end[-1] == '\n'))
+        --end;
+    return (http_str){p, end - p};
+}
+
+static int str_is(http_str s, const char *lit) {
+    size_t n = strlen(lit);
+    return s.len == n && !strncasecmp(s.p, lit, n);
+}
+
+/* delta-seconds, capped at 2^31 as RFC 9111 asks, -1 if malformed */
+static long delta_seconds(http_str s) {
+    long v = 0;
+
+    if (!s.len) return -1;
+    for (size_t i = 0; i < s.len; ++i) {
+        if (s.p[i] < '0' || s.p[i] > '9') return -1;
+        if (v < 2147483648L) v = v * 10 + (s.p[i] - '0');
+    }
+    return v < 2147483648L ? v : 2147483648L;
+}
+
+/* split the next directive off the Cache-Control value [*p, end): its name
+ * and its argument without quotes, empty if it has none. 0 at the end */
+static int next_directive(const char **p, const char *end, http_str *name,
+                          http_str *arg) {
+    const char *s = *p;
+
+    while (s < end && (*s == ' ' || *s == '\t' || *s == ',')) ++s;
+    if (s == end) return 0;
+    name->p = s;
+    while (s < end && *s != '=' && *s != ',' && *s != ' ' && *s != '\t') ++s;
+    name->len = s - name->p;
+    arg->p = s;
+    arg->len = 0;
+    if (s < end && *s == '=') {
+        int quoted = ++s < end && *s == '"';
+        arg->p = s += quoted;
+        while (s < end && (quoted ? *s != '"' : *s != ',' && *s != ' '))
+            ++s;
+        arg->len = s - arg->p;
+    }
+    while (s < end && *s != ',') ++s;
+    *p = s;
+    return 1;
+}
+
+/* split the next header line off [*p, end) of a response header block,
+ * skipping lines without a colon. 0 at the empty line or the end */
+static int next_header(const char **p, const char *end, http_str *name,
+                       http_str *value) {
+    const char *line, *e, *colon;
+
+    while (*p < end) {
+        line = *p;
+        e = (*p = memchr(line, '\n', end - line)) ? (*p)++ : (*p = end);
+        if (e - line <= 1) break; /* the empty line, the body may follow */
+        if (!(colon = memchr(line, ':', e - line))) continue;
+        *name = trim(line, colon);
+        *value = trim(colon + 1, e);
+        return 1;
+    }
+    *p = end;
+    return 0;
+}
+
+/* the header block after its status line */
+static const char *after_status(const char *resp, size_t n) {
+    const char *p = memchr(resp, '\n', n);
+    return p ? p + 1 : resp + n;
+}
+
+int http_find_header(const char *resp, size_t n, const char *name,
+                     size_t len, http_str *value) {
+    const char *p = after_status(resp, n);
+    http_str hname, hvalue;
+
+    while (next_header(&p, resp + n, &hname, &hvalue))
+        if (hname.len == len && !strncasecmp(hname.p, name, len)) {
+            if (value) *value = hvalue;
+            return 1;
+        }
+    return 0;
+}
+
+/* the status code on the status line of resp[0..n), 0 if malformed */
+static int response_status(const char *resp, size_t n) {
+    if (n < 12 || strncmp(resp, "HTTP/1.", 7) || !isdigit(resp[9]) ||
+        !isdigit(resp[10]) || !isdigit(resp[11]))
+        return 0;
+    return (resp[9] - '0') * 100 + (resp[10] - '0') * 10 + resp[11] - '0';
+}
+
+/* statuses a cache may keep without explicit freshness, RFC 9110 15.1 */
+static int heuristic_status(int status) {
+    switch (status) {
+    case 200: case 203: case 204: case 300: case 301: case 308:
+    case 404: case 405: case 410: case 414: case 501:
+        return 1;
+    }
+    return 0;
+}
+
+void http_response_freshness(const char *resp, size_t n, time_t now,
+                             http_freshness *f) {
+    const char *p, *end = resp + n;
+    http_str name, value, dname, arg;
+    long max_age = -1, s_maxage = -1, age = 0;
+    time_t date = -1, expires = -1, last_mod = -1;
+    int has_expires = 0, no_cache = 0, no_stale = 0, status = 0, partial;
+
+    f->store = 1;
+    f->auth_ok = f->validated = f->whole_store = 0;
+    f->lifetime = f->age = 0;
+    f->stale_while = f->stale_error = -1;
+    if ((status = response_status(resp, n)) == 0) {
+        f->store = 0;
+        return;
+    }
+    /* partial content is worked out as the whole object it is part of */
+    if ((partial = status == 206)) status = 200;
+    /* a 304 is an answer for one client, not the object */
+    if (status < 200 || status == 304) f->store = 0;
+
+    for (p = after_status(resp, n); next_header(&p, end, &name, &value);) {
+        if (str_is(name, "Cache-Control")) {
+            const char *d = value.p;
+            while (next_directive(&d, value.p + value.len, &dname, &arg)) {
+                if (str_is(dname, "no-store") || str_is(dname, "private"))
+                    f->store = 0;
+                else if (str_is(dname, "no-cache"))
+                    no_cache = 1;
+                else if (str_is(dname, "max-age"))
+                    max_age = delta_seconds(arg);
+                else if (str_is(dname, "s-maxage"))
+                    /* it implies proxy-revalidate too */
+                    f->auth_ok = no_stale =
+                        (s_maxage = delta_seconds(arg)) >= 0;
+                else if (str_is(dname, "public"))
+                    f->auth_ok = 1;
+                else if (str_is(dname, "must-revalidate"))
+                    f->auth_ok = no_stale = 1;
+                else if (str_is(dname, "proxy-revalidate"))
+                    no_stale = 1;
+                else if (str_is(dname, "stale-while-revalidate"))
+                    f->stale_while = delta_seconds(arg);
+                else if (str_is(dname, "stale-if-error"))
+                    f->stale_error = delta_seconds(arg);
+            }
+        } else if (str_is(name, "Expires")) {
+            has_expires = 1;
+            expires = http_parse_date(value.p, value.len);
+        } else if (str_is(name, "Date")) {
+            date = http_parse_date(value.p, value.len);
+        } else if (str_is(name, "Age")) {
+            if ((age = delta_seconds(value)) < 0) age = 0;
+        } else if (str_is(name, "Last-Modified")) {
+            last_mod = http_parse_date(value.p, value.len);
+            f->validated = 1;
+        } else if (str_is(name, "ETag")) {
+            f->validated = 1;
+        } else if (str_is(name, "Vary")) {
+            /* we keep one variant per url and can't tell them apart */
+            f->store = 0;
+        }
+    }
+
+    /* how long it had aged: by the Age header, or by its Date if our clock
+     * says more */
+    f->age = date >= 0 && now - date > age ? now - date : age;
+    if (date < 0) date = now;
+    if (s_maxage >= 0)
+        f->lifetime = s_maxage;
+    else if (max_age >= 0)
+        f->lifetime = max_age;
+    else if (has_expires) /* an invalid date means already expired */
+        f->lifetime = expires > date ? expires - date : 0;
+    else if (!heuristic_status(status))
+        f->store = 0;
+    else if (last_mod >= 0 && last_mod < date)
+        f->lifetime = (date - last_mod) / 10 < HTTP_HEURISTIC_MAX
+                          ? (date - last_mod) / 10
+                          : HTTP_HEURISTIC_MAX;
+    else
+        f->lifetime = HTTP_HEURISTIC_TTL;
+    /* stored, but never used without asking the server */
+    if (no_cache) f->lifetime = 0;
+    if (no_cache || no_stale) f->stale_while = f->stale_error = 0;
+    /* but partial content itself is an answer for one client too */
+    if (partial) {
+        f->whole_store = f->store;
+        f->store = 0;
+    }
+}
+
+/* split the next entity tag off the list [*p, end), without its W/ since
+ * If-None-Match compares them weakly. 0 at the end */
+static int next_etag(const char **p, const char *end, http_str *tag) {
+    const char *s = *p, *q;
+
+    while (s < end && (*s == ' ' || *s == '\t' || *s == ',')) ++s;
+    if (s == end) return 0;
+    if (end - s > 2 && s[0] == 'W' && s[1] == '/') s += 2;
+    tag->p = s;
+    if (*s == '"' && (q = memchr(s + 1, '"', end - s - 1)) != NULL)
+        s = q + 1;
+    else
+        while (s < end && *s != ',') ++s;
+    tag->len = s - tag->p;
+    *p = s;
+    return 1;
+}
+
+int http_not_modified(http_request *req, const char *resp, size_t n) {
+    http_str etag = {NULL, 0}, last_mod, tag;
+    const char *e;
+    int has_inm = 0, match = 0;
+    time_t since = -1, modified;
+
+    /* preconditions only apply to what would be a 2xx */
+    if (response_status(resp, n) / 100 != 2) return 0;
+    if (http_find_header(resp, n, "ETag", 4, &etag)) {
+        e = etag.p;
+        next_etag(&e, etag.p + etag.len, &etag);
+    }
+    for (int i = 0; i < req->nhdrs; ++i) {
+        http_header *h = &req->hdrs[i];
+        const char *p = h->value.p, *end = p + h->value.len;
+
+        if (str_is(h->name, "If-None-Match")) {
+            has_inm = 1;
+            while (next_etag(&p, end, &tag))
+                if (str_is(tag, "*") ||
+                    (etag.len && tag.len == etag.len &&
+                     !memcmp(tag.p, etag.p, tag.len)))
+                    match = 1;
+        } else if (str_is(h->name, "If-Modified-Since")) {
+            since = http_parse_date(h->value.p, h->value.len);
+        }
+    }
+    /* If-None-Match overrides If-Modified-Since, RFC 9110 13.2.2 */
+    if (has_inm) return match;
+    return since >= 0 &&
+           http_find_header(resp, n, "Last-Modified", 13, &last_mod) &&
+           (modified = http_parse_date(last_mod.p, last_mod.len)) >= 0 &&
+           modified <= since;
+}
+
+/* whether If-Range value v holds for the response resp[0..n): an entity
+ * tag compared strongly with its ETag, or its exact Last-Modified date */
+static int if_range_holds(http_str v, const char *resp, size_t n) {
+    http_str etag, last_mod;
+    time_t date;
+
+    if (v.len && v.p[0] == '"')
+        return http_find_header(resp, n, "ETag", 4, &etag) &&
+               etag.len == v.len && !memcmp(etag.p, v.p, v.len);
+    if (v.len > 1 && v.p[0] == 'W' && v.p[1] == '/') return 0;
+    return (date = http_parse_date(v.p, v.len)) >= 0 &&
+           http_find_header(resp, n, "Last-Modified", 13, &last_mod) &&
+           http_parse_date(last_mod.p, last_mod.len) == date;
+}
+
+/* parse a non-negative decimal in [*p, end), -1 if there is none */
+static long range_number(const char **p, const char *end) {
+    long v = -1;
+
+    for (; *p < end && isdigit(**p); ++*p)
+        if ((v = (v < 0 ? 0 : v) * 10 + (**p - '0')) > LONG_MAX / 10)
+            return -1;
+    return v;
+}
+
+int http_request_ranges(http_request *req, const char *resp, size_t n,
+                        long size, http_range *r) {
+    http_str range = {NULL, 0}, if_range = {NULL, 0}, spec;
+    const char *p, *end;
+    int nranges = 0;
+
+    for (int i = 0; i < req->nhdrs; ++i)
+        if (str_is(req->hdrs[i].name, "Range"))
+            range = req->hdrs[i].value;
+        else if (str_is(req->hdrs[i].name, "If-Range"))
+            if_range = req->hdrs[i].value;
+    /* ranges are only cut from a whole 200 */
+    if (!range.p || response_status(resp, n) != 200) return -1;
+    if (if_range.p && !if_range_holds(if_range, resp, n)) return -1;
+    if (range.len < 6 || strncasecmp(range.p, "bytes=", 6)) return -1;
+
+    end = range.p + range.len;
+    for (p = range.p + 6; p < end; ++p) {
+        const char *comma = memchr(p, ',', end - p), *e;
+        long first, last;
+
+        spec = trim(p, comma ? comma : end);
+        p = spec.p;
+        e = spec.p + spec.len;
+        if (p == e) {
+            /* empty list elements are allowed */
+        } else if (*p == '-') {
+            /* the last bytes of the body */
+            ++p;
+            if ((last = range_number(&p, e)) < 0 || p != e) return -1;
+            if (last > 0 && size > 0) {
+                if (nranges == HTTP_MAX_RANGES) return -1;
+                r[nranges].first = last < size ? size - last : 0;
+                r[nranges++].last = size - 1;
+            }
+        } else {
+            first = range_number(&p, e);
+            if (first < 0 || p == e || *p++ != '-') return -1;
+            /* first- runs to the end of the body, whatever its size */
+            int to_end = p == e;
+            last = to_end ? first : range_number(&p, e);
+            if (last < first || p != e) return -1;
+            /* one starting past the end is unsatisfiable, not malformed */
+            if (first < size) {
+                if (nranges == HTTP_MAX_RANGES) return -1;
+                r[nranges].first = first;
+                r[nranges++].last = to_end || last >= size ? size - 1 : last;
+            }
+        }
+        if (!(p = comma)) break;
+    }
+    return nranges;
+}
+
+void http_request_cache_control(http_request *req, http_cache_req *c) {
+    http_str dname, arg;
+
+    c->max_age = -1;
+    c->no_store = c->authorized = 0;
+    for (int i = 0; i < req->nhdrs; ++i) {
+        http_header *h = &req->hdrs[i];
+        const char *d = h->value.p, *end = d + h->value.len;
+
+        if (str_is(h->name, "Authorization")) {
+            c->authorized = 1;
+        } else if (str_is(h->name, "Pragma")) {
+            if (http_has_token(h->value.p, h->value.len, "no-cache"))
+                c->max_age = 0;
+        } else if (str_is(h->name, "Cache-Control")) {
+            while (next_directive(&d, end, &dname, &arg)) {
+                long v = str_is(dname, "no-cache") ? 0
+                         : str_is(dname, "max-age") ? delta_seconds(arg)
+                                                    : -1;
+                if (str_is(dname, "no-store")) c->no_store = 1;
+                if (v >= 0 && (c->max_age < 0 || v < c->max_age))
+                    c->max_age = v;
+            }
+        }
+    }
+}
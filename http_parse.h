@@ -0,0 +1,142 @@
+#ifndef __HTTP_PARSE_H__
+#define __HTTP_PARSE_H__
+
+#include "csapp.h"
+
+#define HTTP_MAX_HDRS 64
+
+/* a string view into the receive buffer, not NUL-terminated */
+typedef struct {
+    const char *p;
+    size_t len;
+} http_str;
+
+/* well-known header names, found by http_header_id */
+enum http_hdr_id {
+    HDR_OTHER = 0,
+    HDR_HOST,
+    HDR_CONNECTION,
+    HDR_PROXY_CONNECTION,
+    HDR_USER_AGENT,
+};
+
+typedef struct {
+    http_str name;  /* without the colon */
+    http_str value; /* without surrounding whitespace and \r\n */
+    http_str line;  /* the whole line, including its \r\n */
+    int id;         /* HDR_OTHER or another http_hdr_id */
+} http_header;
+
+typedef struct {
+    http_str method, uri, version;
+    int nhdrs;
+    http_header hdrs[HTTP_MAX_HDRS];
+} http_request;
+
+/* copy view s into dst as a C string, dst must hold s.len + 1 bytes */
+static inline char *http_str_copy(char *dst, http_str s) {
+    memcpy(dst, s.p, s.len);
+    dst[s.len] = '\0';
+    return dst;
+}
+
+/* return the length of the header block in buf[0..n), up to and including
+ * its empty line, or 0 if the block is not complete yet */
+size_t http_find_end(const char *buf, size_t n);
+/* parse the request line and headers of the header block buf[0..n), views
+ * in req point into buf. return 0, or -1 if malformed */
+int http_parse_request(const char *buf, size_t n, http_request *req);
+/* classify a header name, case-insensitively */
+int http_header_id(const char *name, size_t len);
+/* read a whole header block from rp into buf (NUL-terminated), leaving any
+ * bytes after it in rp. return its length, 0 on EOF before the block was
+ * complete, or -1 with errno set (EMSGSIZE if it does not fit in maxlen) */
+ssize_t http_read_headers(rio_t *rp, char *buf, size_t maxlen);
+/* whether the comma-separated header value list[0..len) has token in it,
+ * case-insensitively, e.g. "close" in a Connection header */
+int http_has_token(const char *list, size_t len, const char *token);
+
+/* where we are in a body with Transfer-Encoding: chunked */
+typedef struct {
+    int state;
+    uint64_t left; /* bytes left of the current chunk, or its size so far */
+} http_chunked;
+
+static inline void http_chunked_init(http_chunked *c) {
+    c->state = 0;
+    c->left = 0;
+}
+/* follow the framing over the next n bytes of a chunked body. return how
+ * many of them belong to the body, fewer than n only when its end (the
+ * last chunk and trailers) comes first; *done is set once the end passed.
+ * return -1 if the framing is malformed */
+ssize_t http_chunked_feed(http_chunked *c, const char *buf, size_t n,
+                          int *done);
+/* same as http_chunked_feed, but copy the data of the chunks in buf[0..n)
+ * to out, which may be buf, without the framing around them. return how
+ * many bytes of data that is, -1 if the framing is malformed */
+ssize_t http_chunked_decode(http_chunked *c, const char *buf, size_t n,
+                            char *out, int *done);
+
+/* parse an HTTP date in s[0..len), IMF-fixdate or the obsolete RFC 850 and
+ * asctime forms. return -1 if it is none of them */
+time_t http_parse_date(const char *s, size_t len);
+
+/* a response that says nothing about its freshness stays fresh for a tenth
+ * of the time since its Last-Modified, at most HTTP_HEURISTIC_MAX seconds,
+ * or HTTP_HEURISTIC_TTL seconds without one */
+#define HTTP_HEURISTIC_TTL 300
+#define HTTP_HEURISTIC_MAX (24 * 3600)
+
+/* what the headers of a response say about keeping it in a shared cache */
+typedef struct {
+    int store;       /* it may be stored */
+    int auth_ok;     /* even if the request carried Authorization */
+    int validated;   /* it has an ETag or Last-Modified to revalidate by */
+    int whole_store; /* a 206: the whole object it is part of may be */
+    long lifetime;   /* seconds it is fresh, counted from when it was made */
+    long age;        /* seconds since then when it reached us */
+    /* seconds past its lifetime it may be served stale while it is
+     * refreshed, and when the server fails (RFC 5861). -1 if it doesn't
+     * say, 0 if it forbids serving it stale */
+    long stale_while, stale_error;
+} http_freshness;
+/* work out the freshness of the response whose status line and headers
+ * start resp[0..n), received at now (RFC 9111) */
+void http_response_freshness(const char *resp, size_t n, time_t now,
+                             http_freshness *f);
+
+/* find header name[0..len) in the response header block resp[0..n), the
+ * status line first. put its value in *value unless that is NULL and
+ * return whether it is there */
+int http_find_header(const char *resp, size_t n, const char *name,
+                     size_t len, http_str *value);
+
+/* whether the If-None-Match or If-Modified-Since of req say the client
+ * has the response with header block resp[0..n) already, so it may get a
+ * 304 instead (RFC 9110 13.1.2, 13.1.3) */
+int http_not_modified(http_request *req, const char *resp, size_t n);
+
+/* a byte range of a response body, first and last byte included */
+#define HTTP_MAX_RANGES 16
+typedef struct {
+    long first, last;
+} http_range;
+/* the Range of req over the response with header block resp[0..n) and a
+ * body of size bytes (RFC 9110 14.2): its satisfiable ranges go into
+ * r[0..HTTP_MAX_RANGES), return how many, 0 if none is. return -1 if the
+ * whole response is sent instead: req has no Range, one that is not of
+ * bytes, malformed or of too many ranges, its If-Range doesn't hold, or
+ * the response is not a 200 */
+int http_request_ranges(http_request *req, const char *resp, size_t n,
+                        long size, http_range *r);
+
+/* what the Cache-Control of a request asks of the cache */
+typedef struct {
+    long max_age;   /* oldest response it takes, -1 if any fresh one */
+    int no_store;   /* don't store the response */
+    int authorized; /* it carries Authorization */
+} http_cache_req;
+void http_request_cache_control(http_request *req, http_cache_req *c);
+
+#endif /* __HTTP_PARSE_H__ */
@@ -0,0 +1,127 @@
+/*
+ * http_parse_test.c - checks of the Range and conditional request helpers
+ * of http_parse.c against hand-made requests and cached responses
+ *
+ * usage: http_parse_test, exits non-zero if a check fails
+ */
+#include "csapp.h"
+#include "http_parse.h"
+
+static const char *resp =
+    "HTTP/1.1 200 OK\r\n"
+    "ETag: \"r1\"\r\n"
+    "Last-Modified: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+    "Content-Length: 1000\r\n";
+
+static int failures;
+
+/* parse a request with the extra header lines hdrs */
+static void request(http_request *req, char *buf, const char *hdrs)
+{
+    int n = sprintf(buf, "GET http://localhost/ HTTP/1.1\r\n%s\r\n", hdrs);
+    if (http_parse_request(buf, n, req) < 0)
+        app_error("test request does not parse");
+}
+
+/* the ranges hdrs ask of a body of size bytes must be want[0..nwant), or
+ * nwant must be 0 (416) or -1 (the whole body) */
+static void check_ranges(const char *hdrs, const char *r, long size,
+                         int nwant, const long *want)
+{
+    char buf[MAXLINE];
+    http_request req;
+    http_range got[HTTP_MAX_RANGES];
+    int n;
+
+    request(&req, buf, hdrs);
+    n = http_request_ranges(&req, r, strlen(r), size, got);
+    int ok = n == nwant;
+    for (int i = 0; ok && i < n; ++i)
+        ok = got[i].first == want[2 * i] && got[i].last == want[2 * i + 1];
+    if (!ok) {
+        printf("FAIL ranges of %ld bytes: %.*s  got %d:", size,
+               (int)strcspn(hdrs, "\r"), hdrs, n);
+        for (int i = 0; i < n; ++i)
+            printf(" %ld-%ld", got[i].first, got[i].last);
+        printf("\n");
+        failures++;
+    }
+}
+
+static void check_not_modified(const char *hdrs, int want)
+{
+    char buf[MAXLINE];
+    http_request req;
+
+    request(&req, buf, hdrs);
+    if (http_not_modified(&req, resp, strlen(resp)) != want) {
+        printf("FAIL not modified: %.*s  want %d\n",
+               (int)strcspn(hdrs, "\r"), hdrs, want);
+        failures++;
+    }
+}
+
+int main(void)
+{
+    char many[MAXLINE] = "Range: bytes=0-0";
+
+    check_ranges("Range: bytes=0-9\r\n", resp, 1000, 1, (long[]){0, 9});
+    check_ranges("Range: bytes=-5\r\n", resp, 1000, 1, (long[]){995, 999});
+    check_ranges("Range: bytes=-5000\r\n", resp, 1000, 1, (long[]){0, 999});
+    check_ranges("Range: bytes=995-\r\n", resp, 1000, 1, (long[]){995, 999});
+    check_ranges("Range: bytes=990-5000\r\n", resp, 1000, 1,
+                 (long[]){990, 999});
+    check_ranges("Range: bytes=0-1, 10-12\r\n", resp, 1000, 2,
+                 (long[]){0, 1, 10, 12});
+    check_ranges("Range: bytes=0-1,,5-5\r\n", resp, 1000, 2,
+                 (long[]){0, 1, 5, 5});
+    /* unsatisfiable specs are dropped, a 416 if none is left */
+    check_ranges("Range: bytes=999999-\r\n", resp, 1000, 0, NULL);
+    check_ranges("Range: bytes=1000-\r\n", resp, 1000, 0, NULL);
+    check_ranges("Range: bytes=2000-3000\r\n", resp, 1000, 0, NULL);
+    check_ranges("Range: bytes=-0\r\n", resp, 1000, 0, NULL);
+    check_ranges("Range: bytes=999999-, 0-3\r\n", resp, 1000, 1,
+                 (long[]){0, 3});
+    check_ranges("Range: bytes=0-\r\n", resp, 0, 0, NULL);
+    /* malformed or not for us: the whole body */
+    check_ranges("Range: bytes=5-2\r\n", resp, 1000, -1, NULL);
+    check_ranges("Range: bytes=a-2\r\n", resp, 1000, -1, NULL);
+    check_ranges("Range: bytes=-\r\n", resp, 1000, -1, NULL);
+    check_ranges("Range: items=1-2\r\n", resp, 1000, -1, NULL);
+    check_ranges("X-Other: 1\r\n", resp, 1000, -1, NULL);
+    check_ranges("Range: bytes=0-1\r\n", "HTTP/1.1 404 Not Found\r\n", 1000,
+                 -1, NULL);
+    for (int i = 1; i <= HTTP_MAX_RANGES; ++i)
+        sprintf(many + strlen(many), ",%d-%d", i, i);
+    strcat(many, "\r\n");
+    check_ranges(many, resp, 1000, -1, NULL);
+    /* If-Range */
+    check_ranges("Range: bytes=0-3\r\nIf-Range: \"r1\"\r\n", resp, 1000, 1,
+                 (long[]){0, 3});
+    check_ranges("Range: bytes=0-3\r\nIf-Range: \"zz\"\r\n", resp, 1000, -1,
+                 NULL);
+    check_ranges("Range: bytes=0-3\r\nIf-Range: W/\"r1\"\r\n", resp, 1000,
+                 -1, NULL);
+    check_ranges("Range: bytes=0-3\r\n"
+                 "If-Range: Sun, 06 Nov 1994 08:49:37 GMT\r\n",
+                 resp, 1000, 1, (long[]){0, 3});
+    check_ranges("Range: bytes=0-3\r\n"
+                 "If-Range: Sun, 06 Nov 1994 08:49:38 GMT\r\n",
+                 resp, 1000, -1, NULL);
+
+    check_not_modified("If-None-Match: \"r1\"\r\n", 1);
+    check_not_modified("If-None-Match: W/\"x\", W/\"r1\"\r\n", 1);
+    check_not_modified("If-None-Match: *\r\n", 1);
+    check_not_modified("If-None-Match: \"r2\"\r\n", 0);
+    check_not_modified(
+        "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n", 1);
+    check_not_modified(
+        "If-Modified-Since: Sun, 06 Nov 1994 08:49:36 GMT\r\n", 0);
+    check_not_modified("If-Modified-Since: garbage\r\n", 0);
+    check_not_modified("If-None-Match: \"r2\"\r\n"
+                       "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n",
+                       0);
+
+    printf("%s\n", failures ? "FAILED" : "all checks passed");
+    return failures != 0;
+}
@@ -0,0 +1,166 @@
+/*
+ * pool.c - a work-stealing thread pool for blocking connection handlers
+ *
+ * The acceptor hands connections round-robin to per-worker queues, so
+ * workers don't all contend on one queue, and a worker that runs out of
+ * its own work steals from the others before it sleeps. The pool sizes
+ * itself between a minimum and a ceiling, so NTHREADS and SBUFSIZE need
+ * no hand-tuning.
+ */
+#include "pool.h"
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "csapp.h"
+
+static int64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* take a connfd from our own queue, or steal one from another worker's.
+ * dead workers' queues are looked at too, in case something was left */
+static int pool_take(pool_t *pool, int self, int *connfd) {
+    if (sbuf_try_remove(&pool->workers[self].queue, connfd)) return 1;
+    for (int k = 1; k < pool->max; ++k) {
+        pool_worker *w = &pool->workers[(self + k) % pool->max];
+        if (__atomic_load_n(&w->used, __ATOMIC_ACQUIRE) &&
+            sbuf_try_remove(&w->queue, connfd))
+            return 1;
+    }
+    return 0;
+}
+
+/* sleep until pool->ev moves away from ev, or ms milliseconds pass */
+static void pool_sleep(pool_t *pool, unsigned ev, int ms) {
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    syscall(SYS_futex, &pool->ev, FUTEX_WAIT_PRIVATE, ev, &ts, NULL, 0);
+}
+
+/* leave the pool unless it would get too small, return 1 if we did */
+static int pool_leave(pool_t *pool, pool_worker *w) {
+    int n = __atomic_load_n(&pool->nthreads, __ATOMIC_RELAXED);
+    while (n > pool->min)
+        if (__atomic_compare_exchange_n(&pool->nthreads, &n, n - 1, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&w->alive, 0, __ATOMIC_SEQ_CST);
+            printf("pool shrinks to %d threads\n", n - 1);
+            return 1;
+        }
+    return 0;
+}
+
+static void *worker(void *vargp) {
+    pool_worker *w = (pool_worker *)vargp;
+    pool_t *pool = w->pool;
+    int self = w - pool->workers, connfd;
+    int64_t idle_since = now_ms();
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        if (!pool_take(pool, self, &connfd)) {
+            /* count ourselves idle before the last look, so a submit
+             * either sees us asleep or we see its connfd */
+            unsigned ev = __atomic_load_n(&pool->ev, __ATOMIC_SEQ_CST);
+            __atomic_add_fetch(&pool->nidle, 1, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            int got = pool_take(pool, self, &connfd);
+            if (!got) pool_sleep(pool, ev, POOL_IDLE_MS);
+            __atomic_sub_fetch(&pool->nidle, 1, __ATOMIC_SEQ_CST);
+            if (!got) {
+                if (now_ms() - idle_since >= POOL_IDLE_MS &&
+                    pool_leave(pool, w))
+                    break;
+                continue;
+            }
+        }
+        __atomic_store_n(&w->last_take, now_ms(), __ATOMIC_RELAXED);
+        pool->handle(connfd);
+        Close(connfd);
+        idle_since = now_ms();
+    }
+    /* serve what was handed to us while we were leaving */
+    while (sbuf_try_remove(&w->queue, &connfd)) {
+        pool->handle(connfd);
+        Close(connfd);
+    }
+    return NULL;
+}
+
+/* start one more worker unless the pool is at its ceiling. only the
+ * acceptor grows the pool, workers leaving only free slots */
+static void pool_grow(pool_t *pool) {
+    pthread_t tid;
+    pool_worker *w = NULL;
+
+    if (__atomic_load_n(&pool->nthreads, __ATOMIC_RELAXED) >= pool->max)
+        return;
+    for (int i = 0; i < pool->max && w == NULL; ++i)
+        if (!__atomic_load_n(&pool->workers[i].alive, __ATOMIC_ACQUIRE))
+            w = &pool->workers[i];
+    if (w == NULL) return;
+    if (!w->used) {
+        sbuf_init(&w->queue, pool->slots);
+        w->pool = pool;
+        __atomic_store_n(&w->used, 1, __ATOMIC_RELEASE);
+    }
+    w->last_take = now_ms();
+    __atomic_store_n(&w->alive, 1, __ATOMIC_SEQ_CST);
+    /* out of threads is not fatal, the pool we have goes on */
+    if (pthread_create(&tid, NULL, worker, w) != 0) {
+        __atomic_store_n(&w->alive, 0, __ATOMIC_SEQ_CST);
+        return;
+    }
+    int n = __atomic_add_fetch(&pool->nthreads, 1, __ATOMIC_RELAXED);
+    if (n > pool->min) printf("pool grows to %d threads\n", n);
+}
+
+void pool_init(pool_t *pool, int min, int max, int slots,
+               void (*handle)(int connfd)) {
+    pool->min = min < 1 ? 1 : min;
+    pool->max = max < pool->min ? pool->min : max;
+    pool->workers = Calloc(pool->max, sizeof(pool_worker));
+    pool->handle = handle;
+    pool->slots = slots;
+    pool->nthreads = pool->nidle = 0;
+    pool->next = pool->ev = 0;
+    for (int i = 0; i < pool->min; ++i) pool_grow(pool);
+}
+
+void pool_submit(pool_t *pool, int connfd) {
+    int backlog = 0, stalled = 1;
+    int64_t now = now_ms();
+
+    for (int i = 0; i < pool->max; ++i) {
+        pool_worker *w = &pool->workers[i];
+        if (!w->used) continue;
+        backlog += sbuf_count(&w->queue);
+        if (now - __atomic_load_n(&w->last_take, __ATOMIC_RELAXED) <=
+            POOL_STALL_MS)
+            stalled = 0;
+    }
+    /* nobody is free to take it, or the queues are stuck behind slow ones */
+    if (backlog >= __atomic_load_n(&pool->nidle, __ATOMIC_RELAXED) ||
+        (backlog && stalled))
+        pool_grow(pool);
+
+    /* round-robin over live workers, skipping full queues */
+    while (1) {
+        for (int k = 0; k < pool->max; ++k) {
+            pool_worker *w = &pool->workers[pool->next++ % pool->max];
+            if (__atomic_load_n(&w->alive, __ATOMIC_ACQUIRE) &&
+                sbuf_try_insert(&w->queue, connfd))
+                goto queued;
+        }
+        usleep(1000); /* every queue is full, wait for the workers */
+    }
+queued:
+    /* wake a sleeper, it steals the connfd if it's not its own */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->nidle, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&pool->ev, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &pool->ev, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
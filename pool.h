@@ -0,0 +1,42 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include "sbuf.h"
+
+/* the pool grows by a thread when a connection finds no idle worker, or
+ * when queued connections have not moved for POOL_STALL_MS; a worker idle
+ * for POOL_IDLE_MS exits unless the pool is down to its minimum */
+#define POOL_STALL_MS 50
+#define POOL_IDLE_MS 30000
+
+struct pool;
+
+/* a worker slot, each on its own cache line so workers don't share one */
+typedef struct {
+    sbuf_t queue;       /* connfds handed to this worker, others steal */
+    int used;           /* queue is initialised, it stays so */
+    int alive;          /* a thread runs this slot */
+    int64_t last_take;  /* when the worker last took a connfd, in ms */
+    struct pool *pool;
+} __attribute__((aligned(64))) pool_worker;
+
+typedef struct pool {
+    pool_worker *workers;      /* max slots */
+    void (*handle)(int connfd);
+    int min, max;              /* bounds of nthreads */
+    int slots;                 /* size of each worker's queue */
+    int nthreads;              /* workers alive */
+    unsigned next;             /* round-robin cursor of the acceptor */
+    /* idle workers sleep on ev, pool_submit bumps it to wake one */
+    unsigned ev __attribute__((aligned(64)));
+    int nidle;                 /* workers asleep or going to sleep */
+} pool_t;
+
+/* start min workers that call handle on every connfd submitted and close
+ * it afterwards, each worker queues up to slots connfds */
+void pool_init(pool_t *pool, int min, int max, int slots,
+               void (*handle)(int connfd));
+/* queue connfd for a worker, growing the pool if it is falling behind */
+void pool_submit(pool_t *pool, int connfd);
+
+#endif /* __POOL_H__ */
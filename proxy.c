@@ -1,57 +1,173 @@
 #include <stdio.h>
+#include <sys/uio.h>
 
 #include "cache.h"
 #include "csapp.h"
-#include "sbuf.h"
+#include "http_parse.h"
+#include "pool.h"
+#include "relay.h"
+#include "upstream.h"
+#include "uring.h"
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
-/* Size of thread pool and sbuf */
-#define NTHREADS 8
+/* Bounds of the thread pool and size of each worker's queue */
+#define NTHREADS_MIN 4
+#define NTHREADS_MAX 256
 #define SBUFSIZE 32
+/* seconds a keep-alive client may stay silent between requests */
+#define CLIENT_IDLE_TIMEOUT 15
+/* threads refreshing stale entries served meanwhile */
+#define REFRESH_THREADS 2
+/* slots of the table of urls a range miss fetches whole, see whole_hint */
+#define WHOLE_HINTS 1024
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr =
     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 "
     "Firefox/10.0.3\r\n";
 static const char *conn_hdr = "Connection: close\r\n";
-static const char *prox_hdr = "Proxy-Connection: close\r\n";
+static const char *keep_conn_hdr = "Connection: keep-alive\r\n";
+/* end server connections are kept for the next request, see upstream.c */
+static const char *upstream_conn_hdr = "Connection: keep-alive\r\n";
 static const char *host_hdr_format = "Host: %s\r\n";
-static const char *request_line_f = "GET %s HTTP/1.0\r\n";
+static const char *request_line_f = "GET %s HTTP/1.1\r\n";
 static const char *endof_hdr = "\r\n";
+static const char *not_modified_line = "HTTP/1.1 304 Not Modified\r\n";
+static const char *partial_line = "HTTP/1.1 206 Partial Content\r\n";
+static const char *unsatisfiable_line =
+    "HTTP/1.1 416 Range Not Satisfiable\r\n";
 
-static const char *connection_key = "Connection";
-static const char *user_agent_key = "User-Agent";
-static const char *proxy_connection_key = "Proxy-Connection";
-static const char *host_key = "Host";
+static const char *content_len_key = "Content-Length:";
+static const char *transfer_enc_key = "Transfer-Encoding:";
+static const char *connection_key = "Connection:";
+static const char *keep_alive_key = "Keep-Alive:";
+static const char *age_key = "Age:";
+static const char *age_hdr_format = "Age: %ld\r\n";
 
-sbuf_t sbuf; /* Shared buffer of connfd */
+/* how the end of a response body is found */
+typedef struct {
+    int chunked;           /* Transfer-Encoding: chunked, see chunks */
+    long left;             /* bytes still to come, -1 if up to EOF */
+    http_chunked chunks;   /* where we are in a chunked body */
+    int done;              /* the whole body was read */
+    int trailing;          /* bytes came after the body */
+    int unchunk;           /* the client gets the data of the chunks only */
+    http_chunked plain;    /* where we are in the body for that */
+} body_frame;
+
+pool_t pool; /* Workers and their queue of connfd */
+
+/* seconds past expiry a response that doesn't say is served stale while
+ * it is refreshed, and when the end server fails (-w and -e) */
+static int stale_while_secs, stale_error_secs;
+
+/* cache_hash of urls whose whole object a 206 showed to fit in cache. a
+ * range miss on them fetches the whole object and cuts the range from it,
+ * on others it asks for the range. direct mapped, a collision forgets one
+ * of them */
+static uint64_t whole_hints[WHOLE_HINTS];
+
+/* urls a refresh thread brings up to date, oldest first */
+typedef struct refresh_job {
+    struct refresh_job *next;
+    char uri[];
+} refresh_job;
+static struct {
+    refresh_job *head, *tail;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} refresh_jobs = {NULL, NULL, PTHREAD_MUTEX_INITIALIZER,
+                  PTHREAD_COND_INITIALIZER};
 
-void *thread(void *vargp);
 void doit(int connfd);
+int serve_request(int connfd, rio_t *rio);
+int forward(int connfd, char *uri, http_request *req, http_cache_req *creq,
+            int in_flight, int keep_alive, int ranged);
+int client_keep_alive(http_request *req);
+int takes_chunked(http_request *req);
+cache_entry *lookup_cached(char *uri, http_cache_req *creq);
+int has_header(http_request *req, const char *name);
+int is_conditional(http_request *req);
+int write_not_modified(int connfd, cache_entry *entry, int keep_alive);
+int write_partial(int connfd, cache_entry *entry, int keep_alive,
+                  http_range *r, int n);
+int write_unchunked(int connfd, cache_entry *entry, int keep_alive);
+int write_cached(int connfd, cache_entry *entry, int keep_alive,
+                 http_request *req);
+int send_cached(int connfd, cache_entry *entry, int keep_alive,
+                http_request *req);
+int send_revalidated(int connfd, char *uri, cache_entry *stale, char *hdrs,
+                     size_t size, long age, int keep_alive,
+                     http_request *req);
+int stale_usable(cache_entry *entry, int window);
+int rangeable(cache_entry *entry);
+int kept_chunked(cache_entry *entry);
+int whole_hinted(char *uri);
+void whole_hint(char *uri, int fits);
+long range_total(char *hdrs, size_t size);
+void set_stale_windows(cache_entry *fill, http_freshness *fresh);
+int serve_stale(int connfd, char *uri, cache_entry *stale, int in_flight,
+                int keep_alive, http_request *req);
+void refresh_later(char *uri);
+void *refresh_thread(void *vargp);
+ssize_t writev_all(int fd, struct iovec *iov, int cnt);
 void parse_uri(char *uri, char *hostname, char *path, int *port);
-void build_http_msg(char *http_msg, char *hostname, char *path, int port,
-                    rio_t *client_rio);
-int connect_endServer(char *hostname, int port);
+int build_http_msg(char *http_msg, char *hostname, char *path,
+                   http_request *req, cache_entry *stale, int whole);
+ssize_t read_body(rio_t *rp, body_frame *f, char *usrbuf, size_t n);
+void send_body(int connfd, body_frame *f, char *block, size_t n);
+void relay_rest(rio_t *server_rio, int connfd, body_frame *f);
+void clienterror(int fd, char *cause, char *errnum, char *shortmsg,
+                 char *longmsg);
 
 int main(int argc, char **argv) {
     int listenfd, connfd;
-    pthread_t tid;
     socklen_t clientlen;
     char hostname[MAXLINE], port[MAXLINE];
     struct sockaddr_storage clientaddr;
+    int opt, use_uring = 0, nshards = CACHE_SHARDS, policy = CACHE_LRU;
+    pthread_t tid;
+    size_t budget = MAX_CACHE_SIZE;
 
-    if (argc != 2) {
-        fprintf(stderr, "usage :%s <port> \n", argv[0]);
+    /* options follow the port, so let getopt see argv[1] as program name */
+    while (argc >= 2 &&
+           (opt = getopt(argc - 1, argv + 1, "us:m:p:w:e:")) != -1) {
+        if (opt == 'u')
+            use_uring = 1;
+        else if (opt == 'w')
+            stale_while_secs = atoi(optarg);
+        else if (opt == 'e')
+            stale_error_secs = atoi(optarg);
+        else if (opt == 's')
+            nshards = atoi(optarg);
+        else if (opt == 'm')
+            budget = strtoul(optarg, NULL, 0);
+        else if (opt == 'p' && !strcmp(optarg, "lru"))
+            policy = CACHE_LRU;
+        else if (opt == 'p' && !strcmp(optarg, "tinylfu"))
+            policy = CACHE_TINYLFU;
+        else
+            argc = 0;
+    }
+    if (argc < 2 || optind != argc - 1) {
+        fprintf(stderr,
+                "usage :%s <port> [-u] [-s nshards] [-m bytes] "
+                "[-p lru|tinylfu] [-w secs] [-e secs]\n",
+                argv[0]);
         exit(1);
     }
 
     signal(SIGPIPE, SIG_IGN);
 
     listenfd = Open_listenfd(argv[1]);
-    cache_init();
-    sbuf_init(&sbuf, SBUFSIZE);
-    for (int i = 0; i < NTHREADS; ++i) Pthread_create(&tid, NULL, thread, NULL);
+    cache_init_opt(nshards, budget, policy);
+    /* -u: drive all I/O with io_uring, it only returns if unavailable */
+    if (use_uring && uring_serve(listenfd) < 0)
+        printf("io_uring unavailable, fall back to thread pool\n");
+    pool_init(&pool, NTHREADS_MIN, NTHREADS_MAX, SBUFSIZE, doit);
+    for (int i = 0; i < REFRESH_THREADS; ++i)
+        Pthread_create(&tid, NULL, refresh_thread, NULL);
 
     while (1) {
         clientlen = sizeof(clientaddr);
@@ -62,126 +178,1007 @@ int main(int argc, char **argv) {
                     MAXLINE, 0);
         printf("Accepted connection from (%s %s).\n", hostname, port);
 
-        /* insert connfd into sbuf */
-        sbuf_insert(&sbuf, connfd);
+        /* hand connfd to a worker, it closes it when done */
+        pool_submit(&pool, connfd);
     }
     Close(listenfd);
-    sbuf_deinit(&sbuf);
     cache_deinit();
     return 0;
 }
 
-void *thread(void *vargp) {
-    Pthread_detach(pthread_self());
-    int connfd = sbuf_remove(&sbuf);
-    doit(connfd);
-    Close(connfd);
-}
-
-/*handle the client HTTP transaction*/
+/* serve the requests of a client connection one after another, so
+ * pipelined ones are answered in order, until the client closes it or says
+ * nothing for CLIENT_IDLE_TIMEOUT seconds */
 void doit(int connfd) {
-    int end_serverfd; /* the end server file descriptor */
+    rio_t rio;
+    struct timeval idle = {CLIENT_IDLE_TIMEOUT, 0};
 
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char endserver_http_msg[MAXLINE];
-    /* store the request line arguments */
-    char hostname[MAXLINE], path[MAXLINE];
-    int port;
+    setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    /* requests sent ahead wait in rio behind the one being served */
+    Rio_readinitb(&rio, connfd);
+    while (serve_request(connfd, &rio))
+        ;
+}
 
-    rio_t rio,
-        server_rio; /* rio is client's rio,server_rio is endserver's rio */
+/* handle one HTTP transaction, return whether the connection goes on */
+int serve_request(int connfd, rio_t *rio) {
+    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE];
+    http_request req; /* views into buf */
+    ssize_t hdr_len;
+    cache_entry *entry;
 
-    Rio_readinitb(&rio, connfd);
-    Rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%s %s %s", method, uri,
-           version); /* read the client request line */
+    /* read the whole request header block, then parse it in place. an
+     * idle client that went away or timed out is closed without a word */
+    if ((hdr_len = http_read_headers(rio, buf, MAXLINE)) <= 0) {
+        if (hdr_len < 0 && errno == EMSGSIZE)
+            clienterror(connfd, "request", "431",
+                        "Request Header Fields Too Large",
+                        "Proxy does not accept headers this long");
+        return 0;
+    }
+    if (http_parse_request(buf, hdr_len, &req) < 0) {
+        clienterror(connfd, "request", "400", "Bad Request",
+                    "Proxy could not parse the request");
+        return 0;
+    }
+    http_str_copy(method, req.method);
+    http_str_copy(uri, req.uri);
 
     if (strcasecmp(method, "GET")) {
         clienterror(connfd, method, "501", "Not Implemented",
                     "Proxy does not implement this method");
-        return;
+        return 0;
+    }
+    int keep_alive = client_keep_alive(&req);
+    http_cache_req creq;
+    http_request_cache_control(&req, &creq);
+
+    if ((entry = lookup_cached(uri, &creq)) != NULL)
+        return send_cached(connfd, entry, keep_alive, &req);
+    /* a stale copy that may be served while it is refreshed is sent at
+     * once, a refresh worker brings it up to date */
+    if (creq.max_age < 0 && (entry = cache_get_stale(uri)) != NULL) {
+        if (stale_usable(entry, entry->stale_while)) {
+            refresh_later(uri);
+            return send_cached(connfd, entry, keep_alive, &req);
+        }
+        cache_put(entry);
     }
+    /* only the first of concurrent misses on uri goes to the endserver,
+     * the others wait for it and then find the object in cache. a client
+     * that wants a response straight from the server doesn't wait */
+    int in_flight = creq.max_age != 0 && cache_flight_begin(uri);
+    if (!in_flight && (entry = lookup_cached(uri, &creq)) != NULL)
+        return send_cached(connfd, entry, keep_alive, &req);
+    return forward(connfd, uri, &req, &creq, in_flight, keep_alive,
+                   has_header(&req, "Range") && !creq.no_store);
+}
+
+/*
+ * get uri from the end server for the client on connfd as req asks, and
+ * fill the cache on the way. a stale copy in cache is revalidated, and
+ * served if the end server fails and it may be. if ranged is set req asks
+ * for a range the cache may hold: when the whole object is known to fit,
+ * it is fetched instead and the range cut from it once it is in cache.
+ * the caller holds the flight of uri if in_flight is set. return whether
+ * the client connection goes on
+ */
+int forward(int connfd, char *uri, http_request *req, http_cache_req *creq,
+            int in_flight, int keep_alive, int ranged) {
+    int end_serverfd; /* the end server file descriptor */
+    char buf[MAXLINE];
+    /* request line and headers all come from one MAXLINE block */
+    char endserver_http_msg[2 * MAXLINE];
+    /* store the request line arguments */
+    char hostname[MAXLINE], path[MAXLINE];
+    int port;
+    rio_t server_rio; /* endserver's rio */
+
+    /* a stale copy, or one older than the client takes, is revalidated:
+     * if the server answers 304 it is sent from cache, or a 304 or a range
+     * of it if the client asks so. a client with other preconditions gets
+     * the server's answer */
+    cache_entry *stale = creq->no_store ? NULL : cache_get_stale(uri);
+    /* the object fits if a copy of it is in cache, or a range of it said
+     * so. if we don't know, the server gets the range as it is */
+    int whole = ranged && ((stale && rangeable(stale)) || whole_hinted(uri));
 
-    if (cache_read(uri, connfd)) return;
     /* parse the uri to get hostname, file path, port */
     parse_uri(uri, hostname, path, &port);
 
     /*build the http header which will send to the end server*/
-    build_http_msg(endserver_http_msg, hostname, path, port, &rio);
+    int revalidating =
+        build_http_msg(endserver_http_msg, hostname, path, req,
+                       is_conditional(req) ? NULL : stale, whole);
 
-    /*connect to the end server*/
-    end_serverfd = connect_endServer(hostname, port);
+    /* send the request, on an idle connection to the end server if there
+     * is one. the server may have closed a reused connection just now, it
+     * then fails before any response byte and we try a new one */
+    size_t msg_len = strlen(endserver_http_msg);
+    ssize_t n;
+    int reused;
+    while ((end_serverfd = upstream_get(hostname, port, &reused)) >= 0) {
+        Rio_readinitb(&server_rio, end_serverfd);
+        if (rio_writen(end_serverfd, endserver_http_msg, msg_len) ==
+                msg_len &&
+            (n = rio_readlineb(&server_rio, buf, MAXLINE)) > 0)
+            break;
+        Close(end_serverfd);
+        end_serverfd = -1;
+        if (!reused) break;
+    }
     if (end_serverfd < 0) {
         printf("connection failed\n");
-        return;
+        return serve_stale(connfd, uri, stale, in_flight, keep_alive, req);
     }
 
-    Rio_readinitb(&server_rio, end_serverfd);
-    /*write the http header to endserver*/
-    Rio_writen(end_serverfd, endserver_http_msg, strlen(endserver_http_msg));
-
     /*receive message from end server and send to the client*/
-    size_t n, size = 0;
-    char data[MAX_OBJECT_SIZE];
+    size_t size = 0;
+    /* headers are staged here and sent with one write */
+    char hdrs[MAXBUF];
+    /* the cache chunk the response is relayed into, NULL if not cached */
+    cache_entry *fill = NULL;
 
     /* whether write to cache */
     int use_cache = 1;
+    /* the body size headers announced */
+    long content_len = -1;
+    /* status line, HTTP/1.1 keeps the connection unless told otherwise */
+    int minor = 0, status = 0;
+    sscanf(buf, "HTTP/1.%d %d", &minor, &status);
+    int server_keep = minor >= 1, chunked = 0;
+    /* the stale copy still holds, or the server failed and the copy may
+     * do: the client gets it, not this response */
+    int not_modified = revalidating && status == 304;
+    int failed =
+        status >= 500 && stale && stale_usable(stale, stale->stale_error);
+    /* only the whole object is cut into the range the client wants, it
+     * gets this response as it is otherwise */
+    whole = whole && status == 200;
+    /* the Age we got, we send our own */
+    long age = 0;
+    /* where the Transfer-Encoding line is in hdrs, a client that can't
+     * take chunked framing doesn't get it */
+    size_t te_at = 0, te_len = 0;
+
+    /* headers line by line, the status line is in buf already */
+    for (; n > 0; n = Rio_readlineb(&server_rio, buf, MAXLINE)) {
+        int last = !strcmp(buf, endof_hdr);
+        char *value = strchr(buf, ':');
+        size_t value_len = value ? strcspn(++value, "\r\n") : 0;
+        int te_line = 0;
 
-    while ((n = Rio_readlineb(&server_rio, buf, MAXLINE)) != 0) {
-        if (((size + n) <= MAX_OBJECT_SIZE) && use_cache) {
-            memcpy(data + size, buf, n);
+        if (!strncasecmp(buf, content_len_key, strlen(content_len_key))) {
+            content_len = atol(value);
+        } else if (!strncasecmp(buf, transfer_enc_key,
+                                strlen(transfer_enc_key))) {
+            chunked = http_has_token(value, value_len, "chunked");
+            te_line = chunked && !takes_chunked(req);
+        } else if (!strncasecmp(buf, connection_key,
+                                strlen(connection_key))) {
+            if (http_has_token(value, value_len, "close")) server_keep = 0;
+            if (http_has_token(value, value_len, "keep-alive"))
+                server_keep = 1;
+            continue; /* hop-by-hop, the client gets ours */
+        } else if (!strncasecmp(buf, keep_alive_key,
+                                strlen(keep_alive_key))) {
+            continue;
+        } else if (!strncasecmp(buf, age_key, strlen(age_key))) {
+            age = atol(value);
+            continue;
+        }
+        if (((size + n) <= sizeof(hdrs)) && use_cache) {
+            if (te_line) {
+                te_at = size;
+                te_len = n;
+            }
+            memcpy(hdrs + size, buf, n);
             size += n;
         } else {
+            /* absurdly long headers, send what we staged and go on */
+            int through = !not_modified && !failed && !whole;
+            if (use_cache && through) Rio_writen(connfd, hdrs, size);
             use_cache = 0;
+            /* the empty line goes out after our Connection header */
+            if (!last && through && !te_line) Rio_writen(connfd, buf, n);
         }
-        printf("proxy received %d bytes,then send\n", n);
-        printf("proxy has received %d bytes\n", size);
-        Rio_writen(connfd, buf, n);
+        if (last) break;
+    }
+    if (n <= 0 || failed) {
+        /* the server hung up in the middle of headers, or failed */
+        Close(end_serverfd);
+        return serve_stale(connfd, uri, stale, in_flight, keep_alive, req);
+    }
+    if (not_modified) {
+        /* a 304 has no body, the connection is ready for the next one */
+        keep_alive = send_revalidated(connfd, uri, stale,
+                                      use_cache ? hdrs : NULL, size, age,
+                                      keep_alive, req);
+        if (in_flight) cache_flight_end(uri);
+        if (server_keep && server_rio.rio_cnt == 0)
+            upstream_put(hostname, port, end_serverfd);
+        else
+            Close(end_serverfd);
+        return keep_alive;
+    }
+    if (stale) cache_put(stale);
+
+    /* where the body ends: no body, Content-Length, chunked or EOF */
+    body_frame frame = {chunked, chunked ? -1 : content_len};
+    http_chunked_init(&frame.chunks);
+    if ((status >= 100 && status < 200) || status == 204 || status == 304) {
+        frame.chunked = 0;
+        frame.left = 0;
+    }
+    if (frame.chunked) content_len = -1;
+    /* nobody can tell where the body ends but by the connection closing */
+    int until_eof = !frame.chunked && frame.left < 0;
+    if (until_eof) server_keep = keep_alive = 0;
+    /* an HTTP/1.0 client can't decode chunked framing (RFC 9112 6.1), it
+     * gets the data and the end of the connection tells where it ends */
+    frame.unchunk = frame.chunked && !takes_chunked(req);
+    http_chunked_init(&frame.plain);
+    if (frame.unchunk) keep_alive = 0;
+    if (!frame.unchunk) te_at = te_len = 0;
+
+    /* how long the response may be served from cache, it is stored only
+     * if both it and the request allow that and it is fresh at all */
+    time_t now = time(NULL);
+    http_freshness fresh = {.age = age};
+    if (use_cache) {
+        http_response_freshness(hdrs, size, now, &fresh);
+        if (age > fresh.age) fresh.age = age;
+    }
+    int store = use_cache && fresh.store && !creq->no_store &&
+                (!creq->authorized || fresh.auth_ok) &&
+                (fresh.lifetime > fresh.age || fresh.validated);
+    /* the range is cut from a cached copy, so the object must fit whole.
+     * it used to, but if it won't be cached now, forget that and ask the
+     * server for just the range after all */
+    if (whole && store && content_len >= 0 &&
+        size + content_len <= MAX_OBJECT_SIZE)
+        fill = cache_fill_begin(uri, (long)size + content_len);
+    if (whole && !fill) {
+        whole_hint(uri, 0);
+        Close(end_serverfd);
+        return forward(connfd, uri, req, creq, in_flight, keep_alive, 0);
+    }
+    /* a range of an object that would be cached whole: the next range
+     * miss on it fetches all of it */
+    if (ranged && status == 206 && use_cache) {
+        long total = range_total(hdrs, size);
+        whole_hint(uri, fresh.whole_store && !creq->no_store &&
+                            (!creq->authorized || fresh.auth_ok) &&
+                            total >= 0 && size + total <= MAX_OBJECT_SIZE);
     }
 
+    /* tell the client how old the response is and whether its connection
+     * goes on. the cache keeps the headers without them, each hit gets its
+     * own */
+    const char *conn = keep_alive ? keep_conn_hdr : conn_hdr;
+    char age_hdr[64] = "";
+    if (fresh.age > 0) sprintf(age_hdr, age_hdr_format, fresh.age);
     if (use_cache) {
-        printf("recived %d bytes in total, writing it to cache\n", size);
-        cache_write(uri, data, size);
+        size_t after_te = te_at + te_len;
+        struct iovec iov[5] = {
+            {hdrs, te_len ? te_at : size - strlen(endof_hdr)},
+            {hdrs + after_te,
+             te_len ? size - strlen(endof_hdr) - after_te : 0},
+            {age_hdr, strlen(age_hdr)},
+            {(char *)conn, strlen(conn)},
+            {hdrs + size - strlen(endof_hdr), strlen(endof_hdr)}};
+        if (!whole) writev_all(connfd, iov, 5);
+        /* known in advance that the body won't fit in cache */
+        if (!fill && store &&
+            (content_len < 0 || size + content_len <= MAX_OBJECT_SIZE))
+            fill = cache_fill_begin(
+                uri, content_len < 0 ? -1 : (long)size + content_len);
+        if (fill) {
+            cache_fill_append(fill, hdrs, size);
+            fill->hdrlen = size - strlen(endof_hdr);
+            fill->until_eof = until_eof;
+            fill->born = now - fresh.age;
+            fill->expires = fill->born + fresh.lifetime;
+            set_stale_windows(fill, &fresh);
+        }
+    } else {
+        Rio_writen(connfd, age_hdr, strlen(age_hdr));
+        Rio_writen(connfd, (char *)conn, strlen(conn));
+        Rio_writen(connfd, (char *)endof_hdr, strlen(endof_hdr));
+    }
+
+    /* body in blocks, read straight into the chunk and one write per block */
+    while (fill) {
+        /* the chunk is full, one more byte means the body is too big */
+        size_t room = cache_fill_room(fill);
+        char *block = room ? fill->data + fill->datasize : buf;
+
+        if ((n = read_body(&server_rio, &frame, block,
+                           room ? room : MAXLINE)) <= 0) {
+            if (n < 0) {
+                unix_error("read_body error");
+                cache_fill_abort(fill);
+                fill = NULL;
+                size = 0; /* nothing more to relay either */
+            }
+            break;
+        }
+        if (!whole) send_body(connfd, &frame, block, n);
+        if (block == buf) {
+            cache_fill_abort(fill);
+            fill = NULL;
+        } else {
+            cache_fill_append(fill, block, n);
+        }
+    }
+    /* the end server closed before the body was all there, a cut off
+     * response must not be served to anyone else */
+    if (!whole && fill && !frame.done && !until_eof) {
+        printf("body cut off after %d bytes, not caching it\n",
+               fill->datasize);
+        cache_fill_abort(fill);
+        fill = NULL;
+        size = 0;
+    }
+    /* the whole object is in, the client gets its range of it */
+    if (whole && fill && frame.done) {
+        keep_alive = write_cached(connfd, fill, keep_alive, req);
+    } else if (whole) {
+        if (fill) cache_fill_abort(fill);
+        fill = NULL;
+        size = 0;
+        clienterror(connfd, uri, "502", "Bad Gateway",
+                    "Proxy could not get the whole object from the end server");
+        keep_alive = 0;
+    }
+    /* it won't be cached, so don't keep the waiters until we are done */
+    if (!fill && in_flight) {
+        cache_flight_end(uri);
+        in_flight = 0;
+    }
+    /* cache bypassed, let the kernel move the rest of body */
+    if (!fill && size) relay_rest(&server_rio, connfd, &frame);
+
+    if (fill) {
+        printf("recived %d bytes in total, writing it to cache\n",
+               fill->datasize);
+        cache_fill_commit(fill);
+    }
+    if (in_flight) cache_flight_end(uri);
+    /* the response ended where its framing said, so the connection can
+     * serve the next request */
+    if (server_keep && frame.done && !frame.trailing &&
+        server_rio.rio_cnt == 0)
+        upstream_put(hostname, port, end_serverfd);
+    else
+        Close(end_serverfd);
+    /* the client only finds the end of a body that came whole */
+    return keep_alive && frame.done;
+}
+
+/* whether the client takes chunked framing, HTTP/1.0 doesn't know it */
+int takes_chunked(http_request *req) {
+    return req->version.len == 8 && !strncmp(req->version.p, "HTTP/1.1", 8);
+}
+
+/* whether the client wants its connection kept: HTTP/1.1 does unless it
+ * says close, HTTP/1.0 only if it says keep-alive. we don't read request
+ * bodies, so a request with one ends the connection */
+int client_keep_alive(http_request *req) {
+    int keep = req->version.len == 8 && !strncmp(req->version.p, "HTTP/1.1", 8);
+
+    for (int i = 0; i < req->nhdrs; ++i) {
+        http_header *h = &req->hdrs[i];
+        if (h->id == HDR_CONNECTION || h->id == HDR_PROXY_CONNECTION) {
+            if (http_has_token(h->value.p, h->value.len, "close"))
+                keep = 0;
+            else if (http_has_token(h->value.p, h->value.len, "keep-alive"))
+                keep = 1;
+        } else if ((h->name.len == 14 &&
+                    !strncasecmp(h->name.p, "Content-Length", 14)) ||
+                   (h->name.len == 17 &&
+                    !strncasecmp(h->name.p, "Transfer-Encoding", 17))) {
+            return 0;
+        }
+    }
+    return keep;
+}
+
+/* a cached response for uri the client takes: fresh, and no older than
+ * its Cache-Control asks. NULL if there is none, or it wants the server */
+cache_entry *lookup_cached(char *uri, http_cache_req *creq) {
+    cache_entry *entry;
+
+    if (creq->max_age == 0 || (entry = cache_get(uri)) == NULL) return NULL;
+    if (creq->max_age > 0 && time(NULL) - entry->born > creq->max_age) {
+        cache_put(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+/* whether entry may be served up to window seconds past its expiry */
+int stale_usable(cache_entry *entry, int window) {
+    return entry->hdrlen >= 0 &&
+           (!entry->expires || time(NULL) < entry->expires + window);
+}
+
+/* whether ranges can be cut from the body of entry, it is kept as it came
+ * and a chunked one can't be cut at byte offsets */
+int rangeable(cache_entry *entry) {
+    return entry->hdrlen >= 0 &&
+           !http_find_header(entry->data, entry->hdrlen, "Transfer-Encoding",
+                             17, NULL);
+}
+
+/* whether the body of entry is kept with the chunked framing it came in */
+int kept_chunked(cache_entry *entry) {
+    http_str te;
+    return entry->hdrlen >= 0 &&
+           http_find_header(entry->data, entry->hdrlen, "Transfer-Encoding",
+                            17, &te) &&
+           http_has_token(te.p, te.len, "chunked");
+}
+
+/* whether a range of uri showed its whole object fits in cache */
+int whole_hinted(char *uri) {
+    uint64_t hash = cache_hash(uri);
+    return __atomic_load_n(&whole_hints[hash % WHOLE_HINTS],
+                           __ATOMIC_RELAXED) == hash;
+}
+
+/* remember whether the whole object of uri fits in cache */
+void whole_hint(char *uri, int fits) {
+    uint64_t hash = cache_hash(uri), *slot = &whole_hints[hash % WHOLE_HINTS];
+
+    if (fits)
+        __atomic_store_n(slot, hash, __ATOMIC_RELAXED);
+    else
+        __atomic_compare_exchange_n(slot, &hash, 0, 0, __ATOMIC_RELAXED,
+                                    __ATOMIC_RELAXED);
+}
+
+/* the size of the whole object by the Content-Range of the 206 headers
+ * in hdrs[0..size), -1 if it doesn't say */
+long range_total(char *hdrs, size_t size) {
+    http_str value;
+    char buf[64];
+    long total;
+
+    if (!http_find_header(hdrs, size, "Content-Range", 13, &value) ||
+        value.len >= sizeof(buf) ||
+        sscanf(http_str_copy(buf, value), "bytes %*[0-9]-%*[0-9]/%ld",
+               &total) != 1)
+        return -1;
+    return total;
+}
+
+/* how long fill may be served stale, as its response says or our default */
+void set_stale_windows(cache_entry *fill, http_freshness *fresh) {
+    fill->stale_while =
+        fresh->stale_while >= 0 ? fresh->stale_while : stale_while_secs;
+    fill->stale_error =
+        fresh->stale_error >= 0 ? fresh->stale_error : stale_error_secs;
+}
+
+/* the end server failed: send stale if it may do, an error otherwise.
+ * release stale and end the flight, return whether the client connection
+ * goes on */
+int serve_stale(int connfd, char *uri, cache_entry *stale, int in_flight,
+                int keep_alive, http_request *req) {
+    if (stale && stale_usable(stale, stale->stale_error)) {
+        printf("end server failed, serving a stale copy\n");
+        keep_alive = send_cached(connfd, stale, keep_alive, req);
+    } else {
+        if (stale) cache_put(stale);
+        clienterror(connfd, uri, "502", "Bad Gateway",
+                    "Proxy could not get a response from the end server");
+        keep_alive = 0;
+    }
+    if (in_flight) cache_flight_end(uri);
+    return keep_alive;
+}
+
+/* have a refresh thread fetch uri, unless someone is fetching it already */
+void refresh_later(char *uri) {
+    refresh_job *job;
+
+    if (!cache_flight_try(uri)) return;
+    job = Malloc(sizeof(refresh_job) + strlen(uri) + 1);
+    strcpy(job->uri, uri);
+    job->next = NULL;
+    pthread_mutex_lock(&refresh_jobs.lock);
+    if (refresh_jobs.tail)
+        refresh_jobs.tail->next = job;
+    else
+        refresh_jobs.head = job;
+    refresh_jobs.tail = job;
+    pthread_cond_signal(&refresh_jobs.ready);
+    pthread_mutex_unlock(&refresh_jobs.lock);
+}
+
+/* fetch the uri of each job through the usual miss path, as if a client
+ * asked for it with no headers and the response went to /dev/null */
+void *refresh_thread(void *vargp) {
+    char buf[MAXLINE];
+    http_request req;
+    http_cache_req creq = {-1, 0, 0};
+    int nullfd, n;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&refresh_jobs.lock);
+        while (!refresh_jobs.head)
+            pthread_cond_wait(&refresh_jobs.ready, &refresh_jobs.lock);
+        refresh_job *job = refresh_jobs.head;
+        if (!(refresh_jobs.head = job->next)) refresh_jobs.tail = NULL;
+        pthread_mutex_unlock(&refresh_jobs.lock);
+
+        printf("refreshing %s\n", job->uri);
+        n = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\n\r\n", job->uri);
+        if (n < sizeof(buf) && http_parse_request(buf, n, &req) == 0 &&
+            (nullfd = open("/dev/null", O_WRONLY)) >= 0) {
+            forward(nullfd, job->uri, &req, &creq, 1, 0, 0);
+            Close(nullfd);
+        } else {
+            cache_flight_end(job->uri);
+        }
+        Free(job);
+    }
+    return NULL;
+}
+
+static int header_is(http_str name, const char *lit) {
+    return name.len == strlen(lit) && !strncasecmp(name.p, lit, name.len);
+}
+
+/* whether req has a header called name */
+int has_header(http_request *req, const char *name) {
+    for (int i = 0; i < req->nhdrs; ++i)
+        if (header_is(req->hdrs[i].name, name)) return 1;
+    return 0;
+}
+
+/* whether the client's request has preconditions we don't evaluate
+ * against the cache, our own validators would get in the way of those */
+int is_conditional(http_request *req) {
+    return has_header(req, "If-Match") ||
+           has_header(req, "If-Unmodified-Since");
+}
+
+/* headers that frame a body: those of a 304 don't describe the stored
+ * one, those of a stored one don't describe a range of it */
+static int framing_header(const char *name, size_t len) {
+    return (len == 14 && !strncasecmp(name, "Content-Length", len)) ||
+           (len == 17 && !strncasecmp(name, "Transfer-Encoding", len));
+}
+
+/* headers a 304 repeats from the response it stands for, RFC 9110 15.4.5 */
+static int not_modified_header(const char *name, size_t len) {
+    static const char *names[] = {"Cache-Control", "Content-Location",
+                                  "Date",          "ETag",
+                                  "Expires",       "Last-Modified",
+                                  "Vary"};
+
+    for (int i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+        if (len == strlen(names[i]) && !strncasecmp(name, names[i], len))
+            return 1;
+    return 0;
+}
+
+/* headers of a 200 its 206 repeats: all but the framing of the body, and
+ * its Content-Type too if the ranges go in a multipart/byteranges */
+static int single_part_header(const char *name, size_t len) {
+    return !framing_header(name, len);
+}
+
+static int multipart_header(const char *name, size_t len) {
+    return !framing_header(name, len) &&
+           !(len == 12 && !strncasecmp(name, "Content-Type", len));
+}
+
+/* copy the header lines of entry that keep picks into buf, those that fit
+ * in room bytes; return how many bytes were copied */
+static size_t copy_headers(cache_entry *entry, char *buf, size_t room,
+                           int (*keep)(const char *, size_t)) {
+    const char *line, *eol, *colon, *end = entry->data + entry->hdrlen;
+    size_t n = 0;
+
+    for (line = memchr(entry->data, '\n', entry->hdrlen) + 1; line < end;
+         line = eol + 1) {
+        eol = memchr(line, '\n', end - line);
+        colon = memchr(line, ':', eol - line);
+        if (colon && keep(line, colon - line) &&
+            n + (eol + 1 - line) <= room) {
+            memcpy(buf + n, line, eol + 1 - line);
+            n += eol + 1 - line;
+        }
+    }
+    return n;
+}
+
+/* tell the client its copy of entry is current: a 304 with the headers
+ * of entry it repeats, our Age and Connection and no body. return whether
+ * the client connection goes on */
+int write_not_modified(int connfd, cache_entry *entry, int keep_alive) {
+    char buf[MAXBUF], *p = buf;
+    /* room kept for what follows them: Age, Connection, the empty line */
+    size_t tail = 128;
+
+    p += sprintf(p, "%s", not_modified_line);
+    p += copy_headers(entry, p, sizeof(buf) - (p - buf) - tail,
+                      not_modified_header);
+    p += sprintf(p, age_hdr_format, (long)(time(NULL) - entry->born));
+    p += sprintf(p, "%s%s", keep_alive ? keep_conn_hdr : conn_hdr, endof_hdr);
+    if (rio_writen(connfd, buf, p - buf) != p - buf) keep_alive = 0;
+    return keep_alive;
+}
+
+/*
+ * send the ranges r[0..n) of the body of entry: a 206 with the range, or
+ * with a multipart/byteranges of them if there are more, a 416 if there
+ * are none. return whether the client connection goes on
+ */
+int write_partial(int connfd, cache_entry *entry, int keep_alive,
+                  http_range *r, int n) {
+    char hdrs[MAXBUF], *p = hdrs, age_hdr[64], boundary[32], closing[64];
+    /* the boundary and headers before each part */
+    char parts[HTTP_MAX_RANGES][MAXLINE / 4];
+    const char *body = entry->data + entry->hdrlen + strlen(endof_hdr);
+    long size = entry->datasize - entry->hdrlen - strlen(endof_hdr), len = 0;
+    /* our headers after those of entry: Content-Type, Content-Range,
+     * Content-Length, Age, Connection and the empty line */
+    size_t tail = 256;
+    struct iovec iov[2 * HTTP_MAX_RANGES + 2];
+    int cnt = 1, m;
+    http_str type;
+
+    if (n == 0) {
+        p += sprintf(p, "%sContent-Range: bytes */%ld\r\n",
+                     unsatisfiable_line, size);
+    } else if (n == 1) {
+        p += sprintf(p, "%s", partial_line);
+        p += copy_headers(entry, p, sizeof(hdrs) - (p - hdrs) - tail,
+                          single_part_header);
+        p += sprintf(p, "Content-Range: bytes %ld-%ld/%ld\r\n", r[0].first,
+                     r[0].last, size);
+        len = r[0].last - r[0].first + 1;
+        iov[cnt++] = (struct iovec){(char *)body + r[0].first, len};
+    } else {
+        sprintf(boundary, "%016llx",
+                (unsigned long long)(entry->hash ^ entry->born));
+        p += sprintf(p, "%s", partial_line);
+        p += copy_headers(entry, p, sizeof(hdrs) - (p - hdrs) - tail,
+                          multipart_header);
+        p += sprintf(p, "Content-Type: multipart/byteranges; boundary=%s\r\n",
+                     boundary);
+        int typed = http_find_header(entry->data, entry->hdrlen,
+                                     "Content-Type", 12, &type) &&
+                    type.len < MAXLINE / 8;
+        for (int i = 0; i < n; ++i) {
+            m = sprintf(parts[i], "\r\n--%s\r\n", boundary);
+            if (typed)
+                m += sprintf(parts[i] + m, "Content-Type: %.*s\r\n",
+                             (int)type.len, type.p);
+            m += sprintf(parts[i] + m,
+                         "Content-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                         r[i].first, r[i].last, size);
+            iov[cnt++] = (struct iovec){parts[i], m};
+            iov[cnt++] = (struct iovec){(char *)body + r[i].first,
+                                        r[i].last - r[i].first + 1};
+            len += m + r[i].last - r[i].first + 1;
+        }
+        m = sprintf(closing, "\r\n--%s--\r\n", boundary);
+        iov[cnt++] = (struct iovec){closing, m};
+        len += m;
+    }
+    sprintf(age_hdr, age_hdr_format, (long)(time(NULL) - entry->born));
+    p += sprintf(p, "Content-Length: %ld\r\n%s%s%s", len, age_hdr,
+                 keep_alive ? keep_conn_hdr : conn_hdr, endof_hdr);
+    iov[0] = (struct iovec){hdrs, p - hdrs};
+    if (writev_all(connfd, iov, cnt) < 0) keep_alive = 0;
+    return keep_alive;
+}
+
+/* send entry, whose body is kept chunked, to a client that can't take
+ * that: the data of the chunks with a Content-Length. return whether the
+ * client connection goes on */
+int write_unchunked(int connfd, cache_entry *entry, int keep_alive) {
+    char hdrs[MAXBUF], *p = hdrs;
+    const char *raw = entry->data + entry->hdrlen + strlen(endof_hdr);
+    size_t rawlen = entry->datasize - entry->hdrlen - strlen(endof_hdr);
+    char *body = Malloc(rawlen > 0 ? rawlen : 1);
+    /* room for Content-Length, Age, Connection and the empty line */
+    size_t tail = 128;
+    http_chunked c;
+    ssize_t len;
+    int done;
+
+    http_chunked_init(&c);
+    if ((len = http_chunked_decode(&c, raw, rawlen, body, &done)) < 0) len = 0;
+    /* the status line, then the headers but the chunked framing */
+    const char *eol = memchr(entry->data, '\n', entry->hdrlen);
+    memcpy(p, entry->data, eol + 1 - entry->data);
+    p += eol + 1 - entry->data;
+    p += copy_headers(entry, p, sizeof(hdrs) - (p - hdrs) - tail,
+                      single_part_header);
+    p += sprintf(p, "Content-Length: %ld\r\n", (long)len);
+    p += sprintf(p, age_hdr_format, (long)(time(NULL) - entry->born));
+    p += sprintf(p, "%s%s", keep_alive ? keep_conn_hdr : conn_hdr, endof_hdr);
+    struct iovec iov[2] = {{hdrs, p - hdrs}, {body, len}};
+    if (writev_all(connfd, iov, 2) < 0) keep_alive = 0;
+    Free(body);
+    return keep_alive;
+}
+
+/* send a cached response with our Age and Connection headers in it, or
+ * what the conditional and Range headers of req ask of it: a 304, or
+ * ranges of its body (req may be NULL). a body kept chunked is decoded
+ * for a client that can't take that. return whether the client
+ * connection goes on */
+int write_cached(int connfd, cache_entry *entry, int keep_alive,
+                 http_request *req) {
+    http_range r[HTTP_MAX_RANGES];
+    int n;
+
+    if (req && entry->hdrlen >= 0) {
+        if (http_not_modified(req, entry->data, entry->hdrlen))
+            return write_not_modified(connfd, entry, keep_alive);
+        if (rangeable(entry) &&
+            (n = http_request_ranges(
+                 req, entry->data, entry->hdrlen,
+                 entry->datasize - entry->hdrlen - strlen(endof_hdr), r)) >= 0)
+            return write_partial(connfd, entry, keep_alive, r, n);
+        if (!takes_chunked(req) && kept_chunked(entry))
+            return write_unchunked(connfd, entry, keep_alive);
+    }
+    if (entry->hdrlen < 0 || entry->until_eof) keep_alive = 0;
+    if (entry->hdrlen < 0) {
+        Rio_writen(connfd, entry->data, entry->datasize);
+    } else {
+        const char *conn = keep_alive ? keep_conn_hdr : conn_hdr;
+        char age_hdr[64];
+        sprintf(age_hdr, age_hdr_format, (long)(time(NULL) - entry->born));
+        struct iovec iov[4] = {
+            {entry->data, entry->hdrlen},
+            {age_hdr, strlen(age_hdr)},
+            {(char *)conn, strlen(conn)},
+            {entry->data + entry->hdrlen, entry->datasize - entry->hdrlen}};
+        if (writev_all(connfd, iov, 4) < 0) keep_alive = 0;
+    }
+    return keep_alive;
+}
+
+/* write_cached, then release entry */
+int send_cached(int connfd, cache_entry *entry, int keep_alive,
+                http_request *req) {
+    keep_alive = write_cached(connfd, entry, keep_alive, req);
+    cache_put(entry);
+    printf("fetch content from cache\n");
+    return keep_alive;
+}
+
+/*
+ * the server answered 304 to our revalidation of stale: send it to the
+ * client and cache a copy whose headers are updated by those of the 304
+ * in hdrs[0..size), which also tell how long it is fresh now. hdrs is
+ * NULL if they didn't fit, stale is sent as it is then, and so it is if
+ * the updated copy doesn't fit in the fill whole. either goes out
+ * as write_cached does for req. release stale and return whether the
+ * client connection goes on
+ */
+int send_revalidated(int connfd, char *uri, cache_entry *stale, char *hdrs,
+                     size_t size, long age, int keep_alive,
+                     http_request *req) {
+    cache_entry *fill = NULL;
+    const char *p, *eol, *colon, *end;
+    time_t now = time(NULL);
+    http_freshness fresh;
+    int cut = 0; /* some of the entry didn't fit in the fill */
+
+    printf("cache block revalidated\n");
+    if (hdrs == NULL || stale->hdrlen < 0 ||
+        (fill = cache_fill_begin(uri, (long)stale->datasize + size)) == NULL)
+        return send_cached(connfd, stale, keep_alive, req);
+
+    /* the stored status line and headers, but those the 304 replaces */
+    end = stale->data + stale->hdrlen;
+    for (p = stale->data; p < end; p = eol + 1) {
+        eol = memchr(p, '\n', end - p);
+        colon = memchr(p, ':', eol - p);
+        if (p == stale->data || !colon ||
+            framing_header(p, colon - p) ||
+            !http_find_header(hdrs, size, p, colon - p, NULL))
+            cut |= cache_fill_append(fill, p, eol + 1 - p);
+    }
+    /* then those of the 304, up to its empty line */
+    end = hdrs + size - strlen(endof_hdr);
+    for (p = memchr(hdrs, '\n', size) + 1; p < end; p = eol + 1) {
+        eol = memchr(p, '\n', end - p);
+        colon = memchr(p, ':', eol - p);
+        if (colon && !framing_header(p, colon - p))
+            cut |= cache_fill_append(fill, p, eol + 1 - p);
+    }
+    fill->hdrlen = fill->datasize;
+    fill->until_eof = stale->until_eof;
+    /* the empty line and the body */
+    cut |= cache_fill_append(fill, stale->data + stale->hdrlen,
+                             stale->datasize - stale->hdrlen);
+    if (cut) {
+        cache_fill_abort(fill);
+        return send_cached(connfd, stale, keep_alive, req);
+    }
+    cache_put(stale);
+
+    http_response_freshness(fill->data, fill->hdrlen, now, &fresh);
+    if (age > fresh.age) fresh.age = age;
+    fill->born = now - fresh.age;
+    fill->expires = fill->born + fresh.lifetime;
+    set_stale_windows(fill, &fresh);
+    keep_alive = write_cached(connfd, fill, keep_alive, req);
+    if (fresh.store)
+        cache_fill_commit(fill);
+    else
+        cache_fill_abort(fill);
+    return keep_alive;
+}
+
+/* write all of iov with as few syscalls as we can, -1 on error */
+ssize_t writev_all(int fd, struct iovec *iov, int cnt) {
+    ssize_t n, total = 0;
+
+    while (cnt > 0) {
+        if ((n = writev(fd, iov, cnt)) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        total += n;
+        /* skip what went out, a partial write leaves us inside one */
+        for (; cnt > 0 && n >= (ssize_t)iov->iov_len; ++iov, --cnt)
+            n -= iov->iov_len;
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
     }
-    Close(end_serverfd);
+    return total;
 }
 
-void build_http_msg(char *http_msg, char *hostname, char *path, int port,
-                    rio_t *client_rio) {
-    char buf[MAXLINE], request_line[MAXLINE], other_hdr[MAXLINE],
-        host_hdr[MAXLINE];
+/* build the request to the end server in http_msg. if stale is not NULL,
+ * ask it conditionally with the validators of stale instead of those of
+ * the client, which are checked against the copy later; return how many
+ * were added. if whole is set, ask for the whole object, not the range
+ * the client wants */
+int build_http_msg(char *http_msg, char *hostname, char *path,
+                   http_request *req, cache_entry *stale, int whole) {
+    char *p = http_msg;
+    http_header *host = NULL;
+    http_str etag, last_mod;
+    int has_etag = 0, has_last_mod = 0;
+
     /* request line */
-    sprintf(request_line, request_line_f, path);
-    /*get other request header for client rio and change it */
-    while (Rio_readlineb(client_rio, buf, MAXLINE) > 0) {
-        if (strcmp(buf, endof_hdr) == 0) break; /*EOF*/
-
-        if (!strncasecmp(buf, host_key, strlen(host_key))) /*Host:*/
-        {
-            strcpy(host_hdr, buf);
+    p += sprintf(p, request_line_f, path);
+    /* host header, if client msg didn't have one we make our own */
+    for (int i = 0; i < req->nhdrs; ++i)
+        if (req->hdrs[i].id == HDR_HOST) host = &req->hdrs[i];
+    if (host) {
+        memcpy(p, host->line.p, host->line.len);
+        p += host->line.len;
+    } else {
+        p += sprintf(p, host_hdr_format, hostname);
+    }
+    p += sprintf(p, "%s%s", upstream_conn_hdr, user_agent_hdr);
+    /* validators of the stale copy, if they are of a sane length */
+    if (stale && stale->hdrlen >= 0) {
+        has_etag =
+            http_find_header(stale->data, stale->hdrlen, "ETag", 4, &etag) &&
+            etag.len < MAXLINE / 4;
+        has_last_mod = http_find_header(stale->data, stale->hdrlen,
+                                        "Last-Modified", 13, &last_mod) &&
+                       last_mod.len < MAXLINE / 4;
+    }
+    /* other header except host/user_agent/conn/proxy goes as it is, the
+     * client's validators only if we have none */
+    for (int i = 0; i < req->nhdrs; ++i) {
+        http_str name = req->hdrs[i].name;
+        if (req->hdrs[i].id != HDR_OTHER) continue;
+        if ((has_etag || has_last_mod) &&
+            (header_is(name, "If-None-Match") ||
+             header_is(name, "If-Modified-Since")))
             continue;
-        }
+        if (whole && (header_is(name, "Range") || header_is(name, "If-Range")))
+            continue;
+        memcpy(p, req->hdrs[i].line.p, req->hdrs[i].line.len);
+        p += req->hdrs[i].line.len;
+    }
+    if (has_etag)
+        p += sprintf(p, "If-None-Match: %.*s\r\n", (int)etag.len, etag.p);
+    if (has_last_mod)
+        p += sprintf(p, "If-Modified-Since: %.*s\r\n", (int)last_mod.len,
+                     last_mod.p);
+    strcpy(p, endof_hdr);
+    return has_etag + has_last_mod;
+}
+
+/*
+ * read one block of body, at most n bytes, following the framing in f.
+ * return 0 at the end of body (f->done is set if it ended where framing
+ * said, not by EOF), -1 on error
+ */
+ssize_t read_body(rio_t *rp, body_frame *f, char *usrbuf, size_t n) {
+    ssize_t rc, used;
+    int end;
 
-        if (!strncasecmp(buf, connection_key, strlen(connection_key)) &&
-            !strncasecmp(buf, proxy_connection_key,
-                         strlen(proxy_connection_key)) &&
-            !strncasecmp(buf, user_agent_key, strlen(user_agent_key))) {
-            strcat(other_hdr, buf);
+    if (f->done) return 0;
+    if (!f->chunked && f->left >= 0 && n > f->left) n = f->left;
+    if (n == 0) {
+        f->done = 1;
+        return 0;
+    }
+    if ((rc = rio_readblockb(rp, usrbuf, n)) <= 0) return rc;
+    if (f->chunked) {
+        if ((used = http_chunked_feed(&f->chunks, usrbuf, rc, &end)) < 0) {
+            errno = EPROTO;
+            return -1;
         }
+        f->done = end;
+        f->trailing = used < rc; /* dropped, the connection is spoiled */
+        rc = used;
+    } else if (f->left >= 0 && (f->left -= rc) == 0) {
+        f->done = 1;
+    }
+    return rc;
+}
+
+/* send the body bytes block[0..n) to the client, only the data of the
+ * chunks if f says so */
+void send_body(int connfd, body_frame *f, char *block, size_t n) {
+    char out[MAXLINE];
+    ssize_t len;
+    int done;
+
+    if (!f->unchunk) {
+        Rio_writen(connfd, block, n);
+        return;
     }
-    if (strlen(host_hdr) == 0) {
-        sprintf(host_hdr, host_hdr_format, hostname);
+    for (size_t i = 0, k; i < n; i += k) {
+        k = n - i < sizeof(out) ? n - i : sizeof(out);
+        len = http_chunked_decode(&f->plain, block + i, k, out, &done);
+        if (len < 0) return;
+        Rio_writen(connfd, out, len);
     }
-    sprintf(http_msg, "%s%s%s%s%s%s%s", request_line, host_hdr, conn_hdr,
-            prox_hdr, user_agent_hdr, other_hdr, endof_hdr);
-    return;
 }
 
-/* Connect to the end server */
-inline int connect_endServer(char *hostname, int port) {
-    char portStr[100];
-    sprintf(portStr, "%d", port);
-    return Open_clientfd(hostname, portStr);
+/* relay what is left of respond msg, without copying it through user space
+ * unless chunked framing has to be followed */
+void relay_rest(rio_t *server_rio, int connfd, body_frame *f) {
+    char buf[MAXLINE];
+    ssize_t n;
+
+    if (f->chunked) {
+        while ((n = read_body(server_rio, f, buf, sizeof(buf))) > 0)
+            send_body(connfd, f, buf, n);
+        if (n < 0) unix_error("read_body error");
+        return;
+    }
+    /* rio may have read ahead, those bytes go out first */
+    if (server_rio->rio_cnt > 0 && f->left != 0) {
+        n = server_rio->rio_cnt;
+        if (f->left > 0 && n > f->left) n = f->left;
+        Rio_writen(connfd, server_rio->rio_bufptr, n);
+        server_rio->rio_bufptr += n;
+        server_rio->rio_cnt -= n;
+        if (f->left > 0) f->left -= n;
+    }
+    if (f->left != 0) {
+        if ((n = relay_splice(server_rio->rio_fd, connfd, f->left)) < 0) {
+            unix_error("relay_splice error");
+            return;
+        }
+        printf("proxy spliced %zd bytes\n", n);
+        if (f->left > 0 && (f->left -= n) != 0) return; /* cut short */
+    }
+    f->done = f->left == 0;
 }
 
 void parse_uri(char *uri, char *hostname, char *path, int *port) {
@@ -2,12 +2,13 @@
 
 #include "cache.h"
 #include "csapp.h"
-#include "sbuf.h"
+#include "pool.h"
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
-/* Size of thread pool and sbuf */
-#define NTHREADS 8
+/* Bounds of the thread pool and size of each worker's queue */
+#define NTHREADS_MIN 4
+#define NTHREADS_MAX 256
 #define SBUFSIZE 32
 
 /* You won't lose style points for including this long line in your code */
@@ -25,9 +26,8 @@ static const char *user_agent_key = "User-Agent";
 static const char *proxy_connection_key = "Proxy-Connection";
 static const char *host_key = "Host";
 
-sbuf_t sbuf; /* Shared buffer of connfd */
+pool_t pool; /* Workers and their queue of connfd */
 
-void *thread(void *vargp);
 void doit(int connfd);
 void parse_uri(char *uri, char *hostname, char *path, int *port);
 void build_http_msg(char *http_msg, char *hostname, char *path, int port,
@@ -36,7 +36,6 @@ int connect_endServer(char *hostname, int port);
 
 int main(int argc, char **argv) {
     int listenfd, connfd;
-    pthread_t tid;
     socklen_t clientlen;
     char hostname[MAXLINE], port[MAXLINE];
     struct sockaddr_storage clientaddr;
@@ -50,8 +49,7 @@ int main(int argc, char **argv) {
 
     listenfd = Open_listenfd(argv[1]);
     cache_init();
-    sbuf_init(&sbuf, SBUFSIZE);
-    for (int i = 0; i < NTHREADS; ++i) Pthread_create(&tid, NULL, thread, NULL);
+    pool_init(&pool, NTHREADS_MIN, NTHREADS_MAX, SBUFSIZE, doit);
 
     while (1) {
         clientlen = sizeof(clientaddr);
@@ -62,22 +60,14 @@ int main(int argc, char **argv) {
                     MAXLINE, 0);
         printf("Accepted connection from (%s %s).\n", hostname, port);
 
-        /* insert connfd into sbuf, so other thread can fetch the job */
-        sbuf_insert(&sbuf, connfd);
+        /* hand connfd to a worker, so other thread can do the job */
+        pool_submit(&pool, connfd);
     }
     Close(listenfd);
-    sbuf_deinit(&sbuf);
     cache_deinit();
     return 0;
 }
 
-void *thread(void *vargp) {
-    Pthread_detach(pthread_self());
-    int connfd = sbuf_remove(&sbuf);
-    doit(connfd);
-    Close(connfd);
-}
-
 /* get request msg, transfer to server, get respond msg, and transfer to client
  */
 void doit(int connfd) {
@@ -126,27 +116,48 @@ void doit(int connfd) {
     Rio_writen(end_serverfd, endserver_http_msg, strlen(endserver_http_msg));
 
     /* receive msg from endserver and send it to the client */
-    size_t n, size = 0;
+    ssize_t n;
+    size_t size = 0;
 
     /* whether write to cache */
     int use_cache = 1;
     /* buffer whole msg for cache */
     char data[MAX_OBJECT_SIZE];
 
-    while ((n = Rio_readlineb(&server_rio, buf, MAXLINE)) != 0) {
+    /* headers line by line, staged in data and sent with one write */
+    while ((n = Rio_readlineb(&server_rio, buf, MAXLINE)) > 0) {
         if (((size + n) <= MAX_OBJECT_SIZE) && use_cache) {
             memcpy(data + size, buf, n);
             size += n;
         } else { /* too much data for cache to store */
+            if (use_cache) Rio_writen(connfd, data, size);
             use_cache = 0;
+            Rio_writen(connfd, buf, n);
         }
-        printf("proxy received %d bytes,then send\n", n);
-        printf("proxy has received %d bytes\n", size);
-        Rio_writen(connfd, buf, n);
+        if (!strcmp(buf, endof_hdr)) break;
+    }
+    if (use_cache) Rio_writen(connfd, data, size);
+
+    /* body in blocks, read straight into data while it fits, and send each
+     * block with one write */
+    while (1) {
+        int staged = use_cache && size < MAX_OBJECT_SIZE;
+        char *block = staged ? data + size : buf;
+        size_t room = staged ? MAX_OBJECT_SIZE - size : MAXLINE;
+
+        if ((n = rio_readblockb(&server_rio, block, room)) <= 0) {
+            if (n < 0) use_cache = 0;
+            break;
+        }
+        Rio_writen(connfd, block, n);
+        if (staged)
+            size += n;
+        else /* too much data for cache to store */
+            use_cache = 0;
     }
 
     if (use_cache) {
-        printf("recived %d bytes in total, writing it to cache\n", size);
+        printf("recived %zu bytes in total, writing it to cache\n", size);
         cache_write(uri, data, size);
     }
     /* do not forget this */
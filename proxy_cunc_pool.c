@@ -70,9 +70,12 @@ int main(int argc, char **argv) {
 
 void *thread(void *vargp) {
     Pthread_detach(pthread_self());
-    int connfd = sbuf_remove(&sbuf); /* not from arg, but from sbuf */
-    doit(connfd);
-    Close(connfd);
+    /* serve connections for good, not just the first one */
+    while (1) {
+        int connfd = sbuf_remove(&sbuf); /* not from arg, but from sbuf */
+        doit(connfd);
+        Close(connfd);
+    }
 }
 
 /* get request msg, transfer to server, get respond msg, and transfer to client
@@ -117,9 +120,14 @@ void doit(int connfd) {
     Rio_writen(end_serverfd, endserver_http_msg, strlen(endserver_http_msg));
 
     /* receive msg from endserver and send it to the client */
-    size_t n;
-    while ((n = Rio_readlineb(&server_rio, buf, MAXLINE)) != 0) {
-        printf("proxy received %d bytes,then send\n", n);
+    ssize_t n;
+    /* headers line by line, so we know where the body starts */
+    while ((n = Rio_readlineb(&server_rio, buf, MAXLINE)) > 0) {
+        Rio_writen(connfd, buf, n);
+        if (!strcmp(buf, endof_hdr)) break;
+    }
+    /* body in blocks, one write per block */
+    while ((n = rio_readblockb(&server_rio, buf, MAXLINE)) > 0) {
         Rio_writen(connfd, buf, n);
     }
     /* do not forget this */
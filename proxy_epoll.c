@@ -0,0 +1,665 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+
+#include "cache.h"
+#include "csapp.h"
+#include "dns.h"
+#include "http_parse.h"
+#include "timer.h"
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+/* Max events fetched by one epoll_wait, and relay buffer of each connection */
+#define MAX_EVENTS 1024
+#define CONN_BUFSIZE 16384
+/* seconds a client may take to send its request, an endserver to resolve
+ * or to accept our connect on one address, and either side to make any
+ * progress while we relay */
+#define CLIENT_IDLE_TIMEOUT 15
+#define CONNECT_TIMEOUT 5
+#define RELAY_TIMEOUT 60
+
+/* You won't lose style points for including this long line in your code */
+static const char *user_agent_hdr =
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 "
+    "Firefox/10.0.3\r\n";
+static const char *conn_hdr = "Connection: close\r\n";
+static const char *prox_hdr = "Proxy-Connection: close\r\n";
+static const char *host_hdr_format = "Host: %s\r\n";
+static const char *request_line_f = "GET %s HTTP/1.0\r\n";
+static const char *endof_hdr = "\r\n";
+
+/*
+ * every connection walks through these states, each of them waits for
+ * exactly one kind of event on exactly one socket:
+ *   ST_REQUEST: read request line and headers from client
+ *   ST_RESOLVE: wait for the resolver threads to look up endserver
+ *   ST_CONNECT: wait for the non-blocking connect to endserver
+ *   ST_SEND:    write our HTTP/1.0 request msg to endserver
+ *   ST_RELAY:   read respond msg from endserver and write it to client
+ *   ST_REPLY:   write a cached object or an error msg to client, then close
+ */
+enum conn_state {
+    ST_REQUEST,
+    ST_RESOLVE,
+    ST_CONNECT,
+    ST_SEND,
+    ST_RELAY,
+    ST_REPLY
+};
+
+typedef struct conn conn_t;
+
+/* epoll hands us one of these, so we know both the socket and its owner */
+typedef struct {
+    int fd;
+    uint32_t events; /* events we are watching now, 0 if not registered */
+    conn_t *conn;
+} endpoint_t;
+
+struct conn {
+    enum conn_state state;
+    endpoint_t client, server;
+    char uri[MAXLINE];
+    char *out;          /* pending output, points to buf or entry->data */
+    cache_entry *entry; /* pinned cache entry we are sending, or NULL */
+    size_t len, off;    /* bytes in out, bytes already written */
+    char buf[CONN_BUFSIZE];
+    char *data;         /* buffer whole msg for cache, NULL if too much */
+    size_t size, cap;   /* bytes in data and its capacity */
+    int eof;            /* endserver has closed its side */
+    wheel_timer timer;  /* deadline of the state we are in */
+    dns_query *query;   /* lookup of endserver in flight, or NULL */
+    dns_addrs addrs;    /* endserver addresses to try */
+    int next_addr;
+    conn_t *next_free;  /* link of closed connections */
+};
+
+/* every reactor thread owns its epoll, listenfd and connections */
+static __thread int epfd;
+static __thread endpoint_t listen_ep;
+static __thread conn_t *free_list; /* closed in this round, freed after it */
+static __thread timer_wheel wheel;
+static __thread dns_notify dns;     /* lookups of this reactor that finished */
+static __thread endpoint_t dns_ep;  /* dns.fd */
+static int nreactors;
+
+void *reactor(void *vargp);
+void watch(endpoint_t *ep, uint32_t events);
+void accept_clients();
+void conn_close(conn_t *c);
+void on_client(conn_t *c, uint32_t events);
+void on_server(conn_t *c, uint32_t events);
+void handle_request(conn_t *c);
+void on_resolved();
+void resolved(conn_t *c);
+void on_timeout(conn_t *c);
+void start_connect(conn_t *c);
+void finish_connect(conn_t *c);
+void relay(conn_t *c);
+int flush_out(conn_t *c, int fd);
+void reply(conn_t *c);
+void parse_uri(char *uri, char *hostname, char *path, int *port);
+void build_http_msg(char *http_msg, char *hostname, char *path,
+                    http_request *req);
+void build_error(conn_t *c, char *cause, char *errnum, char *shortmsg,
+                 char *longmsg);
+
+int main(int argc, char **argv) {
+    pthread_t tid;
+
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "usage :%s <port> [nreactors [nshards]]\n", argv[0]);
+        exit(1);
+    }
+    /* one event loop per core by default */
+    nreactors = argc >= 3 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nreactors < 1) nreactors = 1;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    cache_init_opt(argc == 4 ? atoi(argv[3]) : CACHE_SHARDS, MAX_CACHE_SIZE,
+                   CACHE_LRU);
+    for (int i = 1; i < nreactors; ++i)
+        Pthread_create(&tid, NULL, reactor, argv[1]);
+    reactor(argv[1]);
+    cache_deinit();
+    return 0;
+}
+
+/*
+ * run one event loop. with several reactors, each of them listens on its
+ * own SO_REUSEPORT socket, so the kernel spreads new connections among
+ * them and they share nothing but the cache
+ */
+void *reactor(void *vargp) {
+    char *port = (char *)vargp;
+    struct epoll_event events[MAX_EVENTS];
+
+    listen_ep.fd = Open_listenfd_opt(port, nreactors > 1);
+    if (listen_ep.fd < 0) exit(1);
+    fcntl(listen_ep.fd, F_SETFL, fcntl(listen_ep.fd, F_GETFL) | O_NONBLOCK);
+
+    if ((epfd = epoll_create1(0)) < 0) {
+        unix_error("epoll_create1 error");
+        exit(1);
+    }
+    watch(&listen_ep, EPOLLIN);
+    if (dns_notify_init(&dns) < 0) {
+        unix_error("eventfd error");
+        exit(1);
+    }
+    dns_ep.fd = dns.fd;
+    watch(&dns_ep, EPOLLIN);
+    wheel_init(&wheel);
+
+    while (1) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, wheel_timeout(&wheel));
+        if (n < 0) {
+            if (errno != EINTR) unix_error("epoll_wait error");
+            continue;
+        }
+        for (int i = 0; i < n; ++i) {
+            endpoint_t *ep = events[i].data.ptr;
+            if (ep == &listen_ep) {
+                accept_clients();
+                continue;
+            }
+            if (ep == &dns_ep) {
+                on_resolved();
+                continue;
+            }
+            conn_t *c = ep->conn;
+            /* closed by an earlier event of this round */
+            if (c->client.fd < 0) continue;
+            if (ep == &c->client)
+                on_client(c, events[i].events);
+            else
+                on_server(c, events[i].events);
+        }
+        wheel_timer *t;
+        while ((t = wheel_expired(&wheel, time(NULL))) != NULL)
+            on_timeout((conn_t *)((char *)t - offsetof(conn_t, timer)));
+        /* nobody can reference them now */
+        while (free_list) {
+            conn_t *c = free_list;
+            free_list = c->next_free;
+            Free(c);
+        }
+    }
+    Close(listen_ep.fd);
+    return NULL;
+}
+
+/*
+ * change the events we watch on ep. EPOLLERR and EPOLLHUP are always
+ * reported, so watching nothing means removing ep from epoll, otherwise a
+ * paused socket that hung up would wake us again and again
+ */
+void watch(endpoint_t *ep, uint32_t events) {
+    struct epoll_event ev;
+    int op;
+
+    if (ep->events == events) return;
+    if (events == 0)
+        op = EPOLL_CTL_DEL;
+    else
+        op = ep->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    ev.events = events;
+    ev.data.ptr = ep;
+    if (epoll_ctl(epfd, op, ep->fd, &ev) < 0) unix_error("epoll_ctl error");
+    ep->events = events;
+}
+
+/* accept every pending client, listenfd is non-blocking */
+void accept_clients() {
+    int connfd;
+    socklen_t clientlen;
+    char hostname[MAXLINE], port[MAXLINE];
+    struct sockaddr_storage clientaddr;
+
+    while (1) {
+        clientlen = sizeof(clientaddr);
+        connfd = accept(listen_ep.fd, (SA *)&clientaddr, &clientlen);
+        if (connfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                unix_error("Accept error");
+            if (errno != EINTR) return;
+            continue;
+        }
+
+        fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+
+        /* print accepted message */
+        Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port,
+                    MAXLINE, NI_NUMERICHOST | NI_NUMERICSERV);
+        printf("Accepted connection from (%s %s).\n", hostname, port);
+
+        conn_t *c = Calloc(1, sizeof(conn_t));
+        c->state = ST_REQUEST;
+        c->client.fd = connfd;
+        c->client.conn = c;
+        c->server.fd = -1;
+        c->server.conn = c;
+        watch(&c->client, EPOLLIN);
+        wheel_arm(&wheel, &c->timer, CLIENT_IDLE_TIMEOUT);
+    }
+}
+
+/* close both sockets, the memory is freed after this round of events */
+void conn_close(conn_t *c) {
+    Close(c->client.fd); /* closing a fd also removes it from epoll */
+    c->client.fd = -1;
+    if (c->server.fd >= 0) Close(c->server.fd);
+    c->server.fd = -1;
+    if (c->entry) cache_put(c->entry);
+    free(c->data);
+    wheel_cancel(&wheel, &c->timer);
+    /* a lookup in flight outlives us, on_resolved frees it */
+    if (c->query) c->query->arg = NULL;
+    c->next_free = free_list;
+    free_list = c;
+}
+
+void on_client(conn_t *c, uint32_t events) {
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        conn_close(c);
+        return;
+    }
+    switch (c->state) {
+        case ST_REQUEST:
+            handle_request(c);
+            break;
+        case ST_RELAY:
+            relay(c);
+            break;
+        case ST_REPLY:
+            reply(c);
+            break;
+        default:
+            conn_close(c);
+    }
+}
+
+void on_server(conn_t *c, uint32_t events) {
+    switch (c->state) {
+        case ST_CONNECT:
+            finish_connect(c);
+            break;
+        case ST_SEND:
+            if (events & EPOLLERR) {
+                conn_close(c);
+                break;
+            }
+            if (flush_out(c, c->server.fd) < 0) {
+                conn_close(c);
+                break;
+            }
+            wheel_arm(&wheel, &c->timer, RELAY_TIMEOUT);
+            if (c->off == c->len) {
+                /* whole request sent, now wait for the respond msg */
+                c->state = ST_RELAY;
+                c->len = c->off = 0;
+                watch(&c->server, EPOLLIN);
+            }
+            break;
+        case ST_RELAY:
+            relay(c);
+            break;
+        default:
+            conn_close(c);
+    }
+}
+
+/* read the request from client, act on it once all headers arrived */
+void handle_request(conn_t *c) {
+    char method[MAXLINE], hostname[MAXLINE], path[MAXLINE];
+    char endserver_http_msg[CONN_BUFSIZE];
+    char portStr[100];
+    int port;
+    ssize_t n;
+
+    /* headers may come in pieces, keep one byte for '\0' */
+    n = read(c->client.fd, c->buf + c->len, MAXLINE - 1 - c->len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (n <= 0) {
+        conn_close(c);
+        return;
+    }
+    c->len += n;
+    c->buf[c->len] = '\0';
+    wheel_arm(&wheel, &c->timer, CLIENT_IDLE_TIMEOUT);
+
+    size_t end = http_find_end(c->buf, c->len);
+    if (end == 0) {
+        if (c->len < MAXLINE - 1) return; /* wait for more */
+        build_error(c, "headers", "400", "Bad Request",
+                    "Proxy does not accept headers this long");
+        return;
+    }
+
+    /* parse request line and headers in place */
+    http_request req;
+    if (http_parse_request(c->buf, end, &req) < 0) {
+        build_error(c, "request", "400", "Bad Request",
+                    "Proxy could not parse the request");
+        return;
+    }
+    http_str_copy(method, req.method);
+    http_str_copy(c->uri, req.uri);
+    if (strcasecmp(method, "GET")) {
+        build_error(c, method, "501", "Not Implemented",
+                    "Proxy does not implement this method");
+        return;
+    }
+
+    /* check cache first */
+    if ((c->entry = cache_get(c->uri)) != NULL) {
+        /* send straight from the pinned entry, it is released on close */
+        c->out = c->entry->data;
+        c->len = c->entry->datasize;
+        c->off = 0;
+        c->state = ST_REPLY;
+        watch(&c->client, EPOLLOUT);
+        return;
+    }
+
+    /* parse the uri to get hostname, file path, port */
+    parse_uri(c->uri, hostname, path, &port);
+
+    /* make our HTTP/1.0 request msg, including request line and headers */
+    build_http_msg(endserver_http_msg, hostname, path, &req);
+    c->len = strlen(endserver_http_msg);
+    if (c->len >= CONN_BUFSIZE) {
+        build_error(c, "headers", "400", "Bad Request",
+                    "Proxy does not accept headers this long");
+        return;
+    }
+    memcpy(c->buf, endserver_http_msg, c->len);
+    c->out = c->buf;
+    c->off = 0;
+
+    /* nothing more to read from client until the respond msg is done */
+    watch(&c->client, 0);
+
+    /* the resolver threads look endserver up, unless dns.c knows it */
+    c->state = ST_RESOLVE;
+    wheel_arm(&wheel, &c->timer, CONNECT_TIMEOUT);
+    c->query = Malloc(sizeof(dns_query));
+    c->query->arg = c;
+    sprintf(portStr, "%d", port);
+    if (dns_lookup_start(hostname, portStr, c->query, &dns))
+        resolved(c);
+}
+
+/* dns.fd is readable, go on with the connections whose lookup finished */
+void on_resolved() {
+    dns_query *q = dns_notify_take(&dns), *next;
+
+    for (; q; q = next) {
+        next = q->next;
+        if (q->arg)
+            resolved(q->arg);
+        else
+            Free(q); /* its connection was closed meanwhile */
+    }
+}
+
+/* the lookup of endserver is done, connect to its addresses in turn */
+void resolved(conn_t *c) {
+    dns_query *q = c->query;
+
+    c->query = NULL;
+    if (q->err) {
+        gai_error(q->err, "getaddrinfo error");
+        Free(q);
+        build_error(c, c->uri, "502", "Bad Gateway",
+                    "Proxy could not resolve the endserver");
+        return;
+    }
+    c->addrs = q->addrs;
+    c->next_addr = 0;
+    Free(q);
+    start_connect(c);
+}
+
+/*
+ * a deadline passed. a lookup or a connect that takes too long gets the
+ * client a 504, a connect moves on to the next address first; a client or
+ * an endserver that stopped talking is closed
+ */
+void on_timeout(conn_t *c) {
+    switch (c->state) {
+        case ST_RESOLVE:
+            c->query->arg = NULL; /* on_resolved frees it */
+            c->query = NULL;
+            break;
+        case ST_CONNECT:
+            Close(c->server.fd);
+            c->server.fd = -1;
+            if (c->next_addr < c->addrs.n) {
+                start_connect(c);
+                return;
+            }
+            break;
+        default:
+            conn_close(c);
+            return;
+    }
+    printf("endserver timed out\n");
+    build_error(c, c->uri, "504", "Gateway Timeout",
+                "Proxy timed out reaching the endserver");
+}
+
+/* start a non-blocking connect to the next address of endserver */
+void start_connect(conn_t *c) {
+    while (c->next_addr < c->addrs.n) {
+        int i = c->next_addr++;
+        struct sockaddr *addr = (struct sockaddr *)&c->addrs.addr[i];
+        int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) continue;
+        if (connect(fd, addr, c->addrs.len[i]) == 0 ||
+            errno == EINPROGRESS) {
+            c->server.fd = fd;
+            c->server.events = 0;
+            c->state = ST_CONNECT;
+            watch(&c->server, EPOLLOUT);
+            wheel_arm(&wheel, &c->timer, CONNECT_TIMEOUT);
+            return;
+        }
+        close(fd);
+    }
+    printf("connection failed\n");
+    build_error(c, c->uri, "502", "Bad Gateway",
+                "Proxy could not connect to the endserver");
+}
+
+/* connect completed or failed, fall back to next address on failure */
+void finish_connect(conn_t *c) {
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+
+    if (getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+        err = errno;
+    if (err) {
+        Close(c->server.fd);
+        c->server.fd = -1;
+        start_connect(c);
+        return;
+    }
+    /* send our HTTP/1.0 request msg to endserver */
+    c->state = ST_SEND;
+    on_server(c, EPOLLOUT);
+}
+
+/*
+ * move respond msg from endserver to client through buf. we only read from
+ * endserver when buf is drained, and only watch client when it is not, so
+ * a slow client throttles its endserver instead of growing our memory
+ */
+void relay(conn_t *c) {
+    ssize_t n;
+
+    wheel_arm(&wheel, &c->timer, RELAY_TIMEOUT);
+    while (1) {
+        if (c->off < c->len) {
+            if (flush_out(c, c->client.fd) < 0) {
+                conn_close(c);
+                return;
+            }
+            if (c->off < c->len) {
+                /* client is full, wait for it */
+                if (c->server.fd >= 0) watch(&c->server, 0);
+                watch(&c->client, EPOLLOUT);
+                return;
+            }
+        }
+        if (c->eof) {
+            conn_close(c);
+            return;
+        }
+
+        n = read(c->server.fd, c->buf, CONN_BUFSIZE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) {
+            /* buf drained, wait for endserver */
+            watch(&c->client, 0);
+            watch(&c->server, EPOLLIN);
+            return;
+        }
+        if (n <= 0) {
+            /* EOF, whole msg received */
+            c->eof = 1;
+            if (n == 0 && c->data) {
+                printf("recived %zu bytes in total, writing it to cache\n",
+                       c->size);
+                cache_write(c->uri, c->data, c->size);
+            }
+            Close(c->server.fd);
+            c->server.fd = -1;
+            continue;
+        }
+
+        /* buffer whole msg for cache, growing as it comes */
+        if (c->size == 0 && c->cap == 0) {
+            c->cap = CONN_BUFSIZE;
+            c->data = Malloc(c->cap);
+        }
+        if (c->data && c->size + n > MAX_OBJECT_SIZE) {
+            /* too much data for cache to store */
+            free(c->data);
+            c->data = NULL;
+        } else if (c->data) {
+            if (c->size + n > c->cap) {
+                while (c->size + n > c->cap) c->cap *= 2;
+                if (c->cap > MAX_OBJECT_SIZE) c->cap = MAX_OBJECT_SIZE;
+                c->data = Realloc(c->data, c->cap);
+            }
+            memcpy(c->data + c->size, c->buf, n);
+            c->size += n;
+        }
+        c->out = c->buf;
+        c->len = n;
+        c->off = 0;
+    }
+}
+
+/* write pending output to fd, return -1 on error */
+int flush_out(conn_t *c, int fd) {
+    while (c->off < c->len) {
+        ssize_t n = write(fd, c->out + c->off, c->len - c->off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return 0;
+            return -1;
+        }
+        c->off += n;
+    }
+    return 0;
+}
+
+/* write a cached object or an error msg to client, then close */
+void reply(conn_t *c) {
+    wheel_arm(&wheel, &c->timer, RELAY_TIMEOUT);
+    if (flush_out(c, c->client.fd) < 0 || c->off == c->len) {
+        if (c->off == c->len && c->out != c->buf)
+            printf("fetch content from cache\n");
+        conn_close(c);
+    }
+}
+
+void build_http_msg(char *http_msg, char *hostname, char *path,
+                    http_request *req) {
+    char *p = http_msg;
+    http_header *host = NULL;
+
+    /* request line */
+    p += sprintf(p, request_line_f, path);
+    /* host header, if client msg didn't have one we make our own */
+    for (int i = 0; i < req->nhdrs; ++i)
+        if (req->hdrs[i].id == HDR_HOST) host = &req->hdrs[i];
+    if (host) {
+        memcpy(p, host->line.p, host->line.len);
+        p += host->line.len;
+    } else {
+        p += sprintf(p, host_hdr_format, hostname);
+    }
+    p += sprintf(p, "%s%s%s", conn_hdr, prox_hdr, user_agent_hdr);
+    /* other header except host/user_agent/conn/proxy goes as it is */
+    for (int i = 0; i < req->nhdrs; ++i) {
+        if (req->hdrs[i].id != HDR_OTHER) continue;
+        memcpy(p, req->hdrs[i].line.p, req->hdrs[i].line.len);
+        p += req->hdrs[i].line.len;
+    }
+    strcpy(p, endof_hdr);
+}
+
+void parse_uri(char *uri, char *hostname, char *path, int *port) {
+    *port = 80;
+    char *pos = strstr(uri, "//");
+
+    pos = pos != NULL ? pos + 2 : uri;
+
+    char *pos2 = strstr(pos, ":");
+    if (pos2 != NULL) {
+        *pos2 = '\0';
+        sscanf(pos, "%s", hostname);
+        sscanf(pos2 + 1, "%d%s", port, path);
+        *pos2 = ':'; /* change it back, since the uri cannot be modified */
+    } else {
+        pos2 = strstr(pos, "/");
+        if (pos2 != NULL) {
+            *pos2 = '\0';
+            sscanf(pos, "%s", hostname);
+            *pos2 = '/'; /* change it back */
+            sscanf(pos2, "%s", path);
+        } else {
+            sscanf(pos, "%s", hostname);
+            sscanf("/", "%s", path);
+        }
+    }
+}
+
+/* same error msg as clienterror(), but queued in buf for ST_REPLY */
+void build_error(conn_t *c, char *cause, char *errnum, char *shortmsg,
+                 char *longmsg) {
+    c->len = snprintf(c->buf, CONN_BUFSIZE,
+                      "HTTP/1.0 %s %s\r\n"
+                      "Content-type: text/html\r\n\r\n"
+                      "<html><title>Tiny Error</title>"
+                      "<body bgcolor=ffffff>\r\n"
+                      "%s: %s\r\n"
+                      "<p>%.512s: %.512s\r\n"
+                      "<hr><em>The Tiny Web server</em>\r\n",
+                      errnum, shortmsg, errnum, shortmsg, longmsg, cause);
+    c->out = c->buf;
+    c->off = 0;
+    c->state = ST_REPLY;
+    wheel_arm(&wheel, &c->timer, RELAY_TIMEOUT);
+    if (c->server.fd >= 0) {
+        Close(c->server.fd);
+        c->server.fd = -1;
+    }
+    watch(&c->client, EPOLLOUT);
+}
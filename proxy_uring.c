@@ -0,0 +1,662 @@
+/*
+ * proxy_uring.c - io_uring I/O engine for proxy, enabled by "proxy <port> -u"
+ *
+ * Like proxy_epoll.c, every connection is a small state machine, but here
+ * we queue the operations themselves (accept, recv, connect, send) instead
+ * of waiting for readiness. A connection has at most one operation in
+ * flight, so when its completion arrives nobody else touches its sockets
+ * and we may close them right away. All sqes queued while handling one
+ * batch of completions go to the kernel in a single io_uring_enter.
+ * Endservers are looked up by the resolver threads of dns.c, which wake the
+ * ring through an eventfd, and a timeout sqe ticks once a second while any
+ * connection has a deadline.
+ */
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "cache.h"
+#include "csapp.h"
+#include "dns.h"
+#include "http_parse.h"
+#include "timer.h"
+#include "uring.h"
+
+/* Recommended max cache and object sizes */
+#define MAX_OBJECT_SIZE 102400
+/* Sqes of the ring, registered relay buffers and size of each */
+#define UR_ENTRIES 1024
+#define UR_NBUFS 256
+#define CONN_BUFSIZE 16384
+/* seconds a client may take to send its request, an endserver to resolve
+ * or to accept our connect on one address, and either side to make any
+ * progress while we relay */
+#define CLIENT_IDLE_TIMEOUT 15
+#define CONNECT_TIMEOUT 5
+#define RELAY_TIMEOUT 60
+
+/* user_data of sqes that are not a connection's, never a conn pointer */
+#define ACCEPT_TAG 0
+#define TICK_TAG 1   /* the timeout that sweeps the timer wheel */
+#define CANCEL_TAG 2 /* cancels of a timed out connection's operation */
+#define DNS_TAG 3    /* poll of the eventfd of finished lookups */
+
+/* You won't lose style points for including this long line in your code */
+static const char *user_agent_hdr =
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 "
+    "Firefox/10.0.3\r\n";
+static const char *conn_hdr = "Connection: close\r\n";
+static const char *prox_hdr = "Proxy-Connection: close\r\n";
+static const char *host_hdr_format = "Host: %s\r\n";
+static const char *request_line_f = "GET %s HTTP/1.0\r\n";
+static const char *endof_hdr = "\r\n";
+
+/*
+ * the operation in flight tells what a completion means:
+ *   ST_REQUEST: recv of request line and headers from client
+ *   ST_RESOLVE: nothing in flight, the resolver threads look up endserver
+ *   ST_CONNECT: connect to endserver
+ *   ST_SEND:    send of our HTTP/1.0 request msg to endserver
+ *   ST_RECV:    recv of respond msg from endserver
+ *   ST_RELAY:   send of that respond msg to client
+ *   ST_REPLY:   send of a cached object or an error msg to client
+ */
+enum conn_state {
+    ST_REQUEST,
+    ST_RESOLVE,
+    ST_CONNECT,
+    ST_SEND,
+    ST_RECV,
+    ST_RELAY,
+    ST_REPLY
+};
+
+typedef struct {
+    enum conn_state state;
+    int clientfd, serverfd;
+    int buf_index;      /* registered buffer of buf, -1 if buf is malloc'ed */
+    char *buf;          /* request headers, request msg, then relay data */
+    char *out;          /* pending output, points to buf or entry->data */
+    cache_entry *entry; /* pinned cache entry we are sending, or NULL */
+    size_t len, off;    /* bytes in out (or in buf while reading request),
+                           bytes already sent */
+    char uri[MAXLINE];
+    char *data;         /* buffer whole msg for cache, NULL if too much */
+    size_t size, cap;   /* bytes in data and its capacity */
+    wheel_timer timer;  /* deadline of the state we are in */
+    int expired;        /* it passed, our operation is being cancelled */
+    dns_query *query;   /* lookup of endserver in flight, or NULL */
+    dns_addrs addrs;    /* endserver addresses to try */
+    int next_addr;
+} uconn_t;
+
+static uring_t ring;
+static int listenfd;
+static int multishot = 1; /* cleared if the kernel rejects multishot accept */
+static char *buf_pool;     /* UR_NBUFS registered buffers, NULL if none */
+static int free_bufs[UR_NBUFS], nfree_bufs;
+static timer_wheel wheel;
+static int ticking; /* the TICK_TAG timeout is queued */
+static struct __kernel_timespec tick = {1, 0};
+static dns_notify dns; /* lookups that finished */
+
+static void arm_accept();
+static void arm_dns();
+static void arm_tick();
+static void arm_timer(uconn_t *c, int seconds);
+static void on_accept(int connfd, unsigned flags);
+static void on_tick();
+static void on_resolved();
+static void resolved(uconn_t *c);
+static void on_timeout(uconn_t *c);
+static void on_expired(uconn_t *c);
+static void on_complete(uconn_t *c, int res);
+static void conn_close(uconn_t *c);
+static void submit_recv(uconn_t *c, int fd, char *buf, size_t n);
+static void submit_send(uconn_t *c, int fd);
+static void handle_request(uconn_t *c);
+static void start_connect(uconn_t *c);
+static void on_respond(uconn_t *c, int n);
+static void parse_uri(char *uri, char *hostname, char *path, int *port);
+static void build_http_msg(char *http_msg, char *hostname, char *path,
+                           http_request *req);
+static void build_error(uconn_t *c, char *cause, char *errnum,
+                        char *shortmsg, char *longmsg);
+
+int uring_serve(int fd) {
+    struct iovec iov[UR_NBUFS];
+    struct io_uring_cqe *cqe;
+
+    if (uring_init(&ring, UR_ENTRIES) < 0) {
+        unix_error("io_uring_setup error");
+        return -1;
+    }
+    listenfd = fd;
+
+    /* relay buffers are pinned once, so the kernel need not map them on
+     * every recv/send. without them we still work, just with plain buffers */
+    buf_pool = Malloc(UR_NBUFS * CONN_BUFSIZE);
+    for (int i = 0; i < UR_NBUFS; ++i) {
+        iov[i].iov_base = buf_pool + i * CONN_BUFSIZE;
+        iov[i].iov_len = CONN_BUFSIZE;
+        free_bufs[nfree_bufs++] = UR_NBUFS - 1 - i;
+    }
+    if (uring_register_buffers(&ring, iov, UR_NBUFS) < 0) {
+        unix_error("io_uring_register error, using plain buffers");
+        Free(buf_pool);
+        buf_pool = NULL;
+        nfree_bufs = 0;
+    }
+
+    if (dns_notify_init(&dns) < 0) {
+        unix_error("eventfd error");
+        return -1;
+    }
+    wheel_init(&wheel);
+    arm_accept();
+    arm_dns();
+    while (1) {
+        if (uring_submit_and_wait(&ring, 1) < 0 && errno != EINTR) {
+            unix_error("io_uring_enter error");
+            continue;
+        }
+        while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+
+            uring_cqe_seen(&ring);
+            if (user_data == ACCEPT_TAG)
+                on_accept(res, flags);
+            else if (user_data == TICK_TAG)
+                on_tick();
+            else if (user_data == DNS_TAG)
+                on_resolved();
+            else if (user_data != CANCEL_TAG)
+                on_complete((uconn_t *)user_data, res);
+        }
+    }
+    return 0;
+}
+
+/* queue an accept on listenfd, one sqe keeps accepting if multishot works */
+static void arm_accept() {
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+
+    if (sqe == NULL) {
+        app_error("io_uring is full, cannot accept");
+        exit(1);
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->ioprio = multishot ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->user_data = ACCEPT_TAG;
+}
+
+/* queue a poll of dns.fd, it completes when a lookup has finished */
+static void arm_dns() {
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+
+    if (sqe == NULL) {
+        app_error("io_uring is full, cannot wait for lookups");
+        exit(1);
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = dns.fd;
+    sqe->poll_events = POLLIN;
+    sqe->user_data = DNS_TAG;
+}
+
+/* queue the timeout that wakes us in a second, unless it is queued */
+static void arm_tick() {
+    struct io_uring_sqe *sqe;
+
+    if (ticking || (sqe = uring_get_sqe(&ring)) == NULL) return;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)&tick;
+    sqe->len = 1;
+    sqe->user_data = TICK_TAG;
+    ticking = 1;
+}
+
+/* (re)arm c's deadline */
+static void arm_timer(uconn_t *c, int seconds) {
+    wheel_arm(&wheel, &c->timer, seconds);
+    arm_tick();
+}
+
+/* a second passed, handle the deadlines that expired. we stop ticking
+ * while no connection has one */
+static void on_tick() {
+    wheel_timer *t;
+
+    ticking = 0;
+    while ((t = wheel_expired(&wheel, time(NULL))) != NULL)
+        on_timeout((uconn_t *)((char *)t - offsetof(uconn_t, timer)));
+    if (wheel.armed) arm_tick();
+}
+
+/*
+ * a deadline of c passed. with an operation in flight we cancel it and
+ * let its completion see c->expired, in ST_RESOLVE there is none
+ */
+static void on_timeout(uconn_t *c) {
+    if (c->state == ST_RESOLVE) {
+        c->query->arg = NULL; /* on_resolved frees it */
+        c->query = NULL;
+        printf("endserver timed out\n");
+        build_error(c, c->uri, "504", "Gateway Timeout",
+                    "Proxy timed out reaching the endserver");
+        return;
+    }
+    c->expired = 1;
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    if (sqe == NULL) return; /* c is closed when its operation ends */
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t)c;
+    sqe->user_data = CANCEL_TAG;
+}
+
+/* the operation of a connection past its deadline ended. a connect moves
+ * on to the next address, or gets the client a 504; anything else is
+ * closed */
+static void on_expired(uconn_t *c) {
+    c->expired = 0;
+    if (c->state != ST_CONNECT) {
+        conn_close(c);
+        return;
+    }
+    Close(c->serverfd);
+    c->serverfd = -1;
+    if (c->next_addr < c->addrs.n) {
+        start_connect(c);
+        return;
+    }
+    printf("endserver timed out\n");
+    build_error(c, c->uri, "504", "Gateway Timeout",
+                "Proxy timed out reaching the endserver");
+}
+
+/* dns.fd is readable, go on with the connections whose lookup finished */
+static void on_resolved() {
+    dns_query *q = dns_notify_take(&dns), *next;
+
+    arm_dns();
+    for (; q; q = next) {
+        next = q->next;
+        if (q->arg)
+            resolved(q->arg);
+        else
+            Free(q); /* its connection was closed meanwhile */
+    }
+}
+
+/* the lookup of endserver is done, connect to its addresses in turn */
+static void resolved(uconn_t *c) {
+    dns_query *q = c->query;
+
+    c->query = NULL;
+    if (q->err) {
+        gai_error(q->err, "getaddrinfo error");
+        Free(q);
+        build_error(c, c->uri, "502", "Bad Gateway",
+                    "Proxy could not resolve the endserver");
+        return;
+    }
+    c->addrs = q->addrs;
+    c->next_addr = 0;
+    Free(q);
+    start_connect(c);
+}
+
+static void on_accept(int connfd, unsigned flags) {
+    char hostname[MAXLINE], port[MAXLINE];
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen = sizeof(clientaddr);
+
+    /* a multishot accept stays armed as long as IORING_CQE_F_MORE is set */
+    if (!(flags & IORING_CQE_F_MORE)) {
+        if (connfd == -EINVAL && multishot) multishot = 0; /* old kernel */
+        arm_accept();
+    }
+    if (connfd < 0) {
+        if (connfd != -EINVAL) posix_error(-connfd, "Accept error");
+        return;
+    }
+
+    /* print accepted message */
+    if (getpeername(connfd, (SA *)&clientaddr, &clientlen) == 0 &&
+        getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port,
+                    MAXLINE, NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+        printf("Accepted connection from (%s %s).\n", hostname, port);
+
+    uconn_t *c = Calloc(1, sizeof(uconn_t));
+    c->clientfd = connfd;
+    c->serverfd = -1;
+    if (nfree_bufs > 0) {
+        c->buf_index = free_bufs[--nfree_bufs];
+        c->buf = buf_pool + c->buf_index * CONN_BUFSIZE;
+    } else {
+        c->buf_index = -1;
+        c->buf = Malloc(CONN_BUFSIZE);
+    }
+    c->state = ST_REQUEST;
+    arm_timer(c, CLIENT_IDLE_TIMEOUT);
+    submit_recv(c, c->clientfd, c->buf, MAXLINE - 1);
+}
+
+static void conn_close(uconn_t *c) {
+    Close(c->clientfd);
+    if (c->serverfd >= 0) Close(c->serverfd);
+    if (c->entry) cache_put(c->entry);
+    if (c->buf_index >= 0)
+        free_bufs[nfree_bufs++] = c->buf_index;
+    else
+        Free(c->buf);
+    free(c->data);
+    wheel_cancel(&wheel, &c->timer);
+    /* a lookup in flight outlives us, on_resolved frees it */
+    if (c->query) c->query->arg = NULL;
+    Free(c);
+}
+
+/* recv into buf, through the registered buffer if buf is one */
+static void submit_recv(uconn_t *c, int fd, char *buf, size_t n) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+
+    if (sqe == NULL) {
+        conn_close(c);
+        return;
+    }
+    sqe->opcode = c->buf_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)buf;
+    sqe->len = n;
+    sqe->buf_index = c->buf_index >= 0 ? c->buf_index : 0;
+    sqe->user_data = (uint64_t)c;
+}
+
+/* send the pending output out[off..len) to fd */
+static void submit_send(uconn_t *c, int fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    int fixed = c->buf_index >= 0 && c->out == c->buf;
+
+    if (sqe == NULL) {
+        conn_close(c);
+        return;
+    }
+    sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(c->out + c->off);
+    sqe->len = c->len - c->off;
+    sqe->buf_index = fixed ? c->buf_index : 0;
+    if (!fixed) sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)c;
+}
+
+static void on_complete(uconn_t *c, int res) {
+    if (c->expired) {
+        on_expired(c);
+        return;
+    }
+    switch (c->state) {
+        case ST_REQUEST:
+            if (res <= 0) {
+                conn_close(c);
+                return;
+            }
+            c->len += res;
+            arm_timer(c, CLIENT_IDLE_TIMEOUT);
+            handle_request(c);
+            return;
+        case ST_CONNECT:
+            if (res < 0) {
+                /* try next address of endserver */
+                Close(c->serverfd);
+                c->serverfd = -1;
+                start_connect(c);
+                return;
+            }
+            c->state = ST_SEND;
+            arm_timer(c, RELAY_TIMEOUT);
+            submit_send(c, c->serverfd);
+            return;
+        case ST_RESOLVE:
+            return; /* nothing is in flight */
+        case ST_RECV:
+            arm_timer(c, RELAY_TIMEOUT);
+            on_respond(c, res);
+            return;
+        case ST_SEND:
+        case ST_RELAY:
+        case ST_REPLY:
+            if (res < 0) {
+                conn_close(c);
+                return;
+            }
+            c->off += res;
+            arm_timer(c, RELAY_TIMEOUT);
+            if (c->off < c->len) { /* short send, go on with the rest */
+                submit_send(c, c->state == ST_SEND ? c->serverfd : c->clientfd);
+                return;
+            }
+            if (c->state == ST_REPLY) {
+                if (c->out != c->buf) printf("fetch content from cache\n");
+                conn_close(c);
+                return;
+            }
+            /* request sent or chunk relayed, receive more respond msg */
+            c->state = ST_RECV;
+            submit_recv(c, c->serverfd, c->buf, CONN_BUFSIZE);
+            return;
+    }
+}
+
+/* act on the request once all headers arrived */
+static void handle_request(uconn_t *c) {
+    char method[MAXLINE], hostname[MAXLINE], path[MAXLINE];
+    char endserver_http_msg[CONN_BUFSIZE];
+    char portStr[100];
+    int port;
+
+    c->buf[c->len] = '\0';
+    size_t end = http_find_end(c->buf, c->len);
+    if (end == 0) {
+        if (c->len < MAXLINE - 1) { /* headers may come in pieces */
+            submit_recv(c, c->clientfd, c->buf + c->len,
+                        MAXLINE - 1 - c->len);
+            return;
+        }
+        build_error(c, "headers", "400", "Bad Request",
+                    "Proxy does not accept headers this long");
+        return;
+    }
+
+    /* parse request line and headers in place */
+    http_request req;
+    if (http_parse_request(c->buf, end, &req) < 0) {
+        build_error(c, "request", "400", "Bad Request",
+                    "Proxy could not parse the request");
+        return;
+    }
+    http_str_copy(method, req.method);
+    http_str_copy(c->uri, req.uri);
+    if (strcasecmp(method, "GET")) {
+        build_error(c, method, "501", "Not Implemented",
+                    "Proxy does not implement this method");
+        return;
+    }
+
+    /* check cache first */
+    if ((c->entry = cache_get(c->uri)) != NULL) {
+        /* send straight from the pinned entry, it is released on close */
+        c->out = c->entry->data;
+        c->len = c->entry->datasize;
+        c->off = 0;
+        c->state = ST_REPLY;
+        submit_send(c, c->clientfd);
+        return;
+    }
+
+    /* parse the uri to get hostname, file path, port */
+    parse_uri(c->uri, hostname, path, &port);
+
+    /* make our HTTP/1.0 request msg, including request line and headers */
+    build_http_msg(endserver_http_msg, hostname, path, &req);
+    c->len = strlen(endserver_http_msg);
+    if (c->len >= CONN_BUFSIZE) {
+        build_error(c, "headers", "400", "Bad Request",
+                    "Proxy does not accept headers this long");
+        return;
+    }
+    memcpy(c->buf, endserver_http_msg, c->len);
+    c->out = c->buf;
+    c->off = 0;
+
+    /* the resolver threads look endserver up, unless dns.c knows it */
+    c->state = ST_RESOLVE;
+    arm_timer(c, CONNECT_TIMEOUT);
+    c->query = Malloc(sizeof(dns_query));
+    c->query->arg = c;
+    sprintf(portStr, "%d", port);
+    if (dns_lookup_start(hostname, portStr, c->query, &dns))
+        resolved(c);
+}
+
+/* queue a connect to the next address of endserver */
+static void start_connect(uconn_t *c) {
+    while (c->next_addr < c->addrs.n) {
+        int i = c->next_addr++;
+        struct sockaddr *addr = (struct sockaddr *)&c->addrs.addr[i];
+        int fd = socket(addr->sa_family, SOCK_STREAM, 0);
+        if (fd < 0) continue;
+
+        struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+        if (sqe == NULL) {
+            close(fd);
+            conn_close(c);
+            return;
+        }
+        c->serverfd = fd;
+        c->state = ST_CONNECT;
+        arm_timer(c, CONNECT_TIMEOUT);
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)addr; /* lives in c->addrs till close */
+        sqe->off = c->addrs.len[i];
+        sqe->user_data = (uint64_t)c;
+        return;
+    }
+    printf("connection failed\n");
+    build_error(c, c->uri, "502", "Bad Gateway",
+                "Proxy could not connect to the endserver");
+}
+
+/* a chunk of respond msg arrived in buf, stage it for cache and relay it */
+static void on_respond(uconn_t *c, int n) {
+    if (n <= 0) {
+        /* EOF, whole msg received */
+        if (n == 0 && c->data) {
+            printf("recived %zu bytes in total, writing it to cache\n",
+                   c->size);
+            cache_write(c->uri, c->data, c->size);
+        }
+        conn_close(c);
+        return;
+    }
+
+    /* buffer whole msg for cache, growing as it comes */
+    if (c->size == 0 && c->cap == 0) {
+        c->cap = CONN_BUFSIZE;
+        c->data = Malloc(c->cap);
+    }
+    if (c->data && c->size + n > MAX_OBJECT_SIZE) {
+        /* too much data for cache to store */
+        free(c->data);
+        c->data = NULL;
+    } else if (c->data) {
+        if (c->size + n > c->cap) {
+            while (c->size + n > c->cap) c->cap *= 2;
+            if (c->cap > MAX_OBJECT_SIZE) c->cap = MAX_OBJECT_SIZE;
+            c->data = Realloc(c->data, c->cap);
+        }
+        memcpy(c->data + c->size, c->buf, n);
+        c->size += n;
+    }
+    c->out = c->buf;
+    c->len = n;
+    c->off = 0;
+    c->state = ST_RELAY;
+    submit_send(c, c->clientfd);
+}
+
+static void build_http_msg(char *http_msg, char *hostname, char *path,
+                           http_request *req) {
+    char *p = http_msg;
+    http_header *host = NULL;
+
+    /* request line */
+    p += sprintf(p, request_line_f, path);
+    /* host header, if client msg didn't have one we make our own */
+    for (int i = 0; i < req->nhdrs; ++i)
+        if (req->hdrs[i].id == HDR_HOST) host = &req->hdrs[i];
+    if (host) {
+        memcpy(p, host->line.p, host->line.len);
+        p += host->line.len;
+    } else {
+        p += sprintf(p, host_hdr_format, hostname);
+    }
+    p += sprintf(p, "%s%s%s", conn_hdr, prox_hdr, user_agent_hdr);
+    /* other header except host/user_agent/conn/proxy goes as it is */
+    for (int i = 0; i < req->nhdrs; ++i) {
+        if (req->hdrs[i].id != HDR_OTHER) continue;
+        memcpy(p, req->hdrs[i].line.p, req->hdrs[i].line.len);
+        p += req->hdrs[i].line.len;
+    }
+    strcpy(p, endof_hdr);
+}
+
+static void parse_uri(char *uri, char *hostname, char *path, int *port) {
+    *port = 80;
+    char *pos = strstr(uri, "//");
+
+    pos = pos != NULL ? pos + 2 : uri;
+
+    char *pos2 = strstr(pos, ":");
+    if (pos2 != NULL) {
+        *pos2 = '\0';
+        sscanf(pos, "%s", hostname);
+        sscanf(pos2 + 1, "%d%s", port, path);
+        *pos2 = ':'; /* change it back, since the uri cannot be modified */
+    } else {
+        pos2 = strstr(pos, "/");
+        if (pos2 != NULL) {
+            *pos2 = '\0';
+            sscanf(pos, "%s", hostname);
+            *pos2 = '/'; /* change it back */
+            sscanf(pos2, "%s", path);
+        } else {
+            sscanf(pos, "%s", hostname);
+            sscanf("/", "%s", path);
+        }
+    }
+}
+
+/* same error msg as clienterror(), but sent through the ring */
+static void build_error(uconn_t *c, char *cause, char *errnum,
+                        char *shortmsg, char *longmsg) {
+    c->len = snprintf(c->buf, CONN_BUFSIZE,
+                      "HTTP/1.0 %s %s\r\n"
+                      "Content-type: text/html\r\n\r\n"
+                      "<html><title>Tiny Error</title>"
+                      "<body bgcolor=ffffff>\r\n"
+                      "%s: %s\r\n"
+                      "<p>%.512s: %.512s\r\n"
+                      "<hr><em>The Tiny Web server</em>\r\n",
+                      errnum, shortmsg, errnum, shortmsg, longmsg, cause);
+    c->out = c->buf;
+    c->off = 0;
+    c->state = ST_REPLY;
+    arm_timer(c, RELAY_TIMEOUT);
+    submit_send(c, c->clientfd);
+}
@@ -0,0 +1,110 @@
+/* splice(2) is a GNU extension, and csapp.h cannot be built with
+ * _GNU_SOURCE (its gai_error clashes with glibc's), so keep it apart */
+#define _GNU_SOURCE
+#include "relay.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define SPLICE_CHUNK 65536
+#define RELAY_PIPE_SIZE (1 << 18) /* ask for a 256 KiB pipe */
+
+static pthread_key_t pipe_key;
+static pthread_once_t pipe_once = PTHREAD_ONCE_INIT;
+
+/* close the pipe when its worker thread exits */
+static void pipe_free(void *vargp) {
+    int *p = (int *)vargp;
+    close(p[0]);
+    close(p[1]);
+    free(p);
+}
+
+static void pipe_key_init() { pthread_key_create(&pipe_key, pipe_free); }
+
+/* return the pipe of calling thread, creating it on first use */
+static int *thread_pipe() {
+    int *p;
+
+    pthread_once(&pipe_once, pipe_key_init);
+    if ((p = pthread_getspecific(pipe_key)) != NULL) return p;
+    if ((p = malloc(2 * sizeof(int))) == NULL) return NULL;
+    if (pipe2(p, O_CLOEXEC) < 0) {
+        free(p);
+        return NULL;
+    }
+    fcntl(p[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE); /* just a hint */
+    pthread_setspecific(pipe_key, p);
+    return p;
+}
+
+/* bytes to move in one go, len < 0 means until EOF */
+static size_t relay_chunk(ssize_t len, ssize_t total) {
+    if (len < 0 || len - total > SPLICE_CHUNK) return SPLICE_CHUNK;
+    return len - total;
+}
+
+/* plain copy, for descriptors splice() does not support */
+static ssize_t relay_copy(int fromfd, int tofd, ssize_t len) {
+    char buf[SPLICE_CHUNK];
+    ssize_t n, m, total = 0;
+
+    while (total != len) {
+        if ((n = read(fromfd, buf, relay_chunk(len, total))) == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        for (ssize_t off = 0; off < n; off += m) {
+            if ((m = write(tofd, buf + off, n - off)) < 0) {
+                if (errno == EINTR) {
+                    m = 0;
+                    continue;
+                }
+                return -1;
+            }
+        }
+        total += n;
+    }
+    return total;
+}
+
+ssize_t relay_splice(int fromfd, int tofd, ssize_t len) {
+    int *p = thread_pipe();
+    ssize_t n, m, total = 0;
+
+    if (p == NULL) return relay_copy(fromfd, tofd, len);
+    while (total != len) {
+        /* socket -> pipe, only page references are moved */
+        n = splice(fromfd, NULL, p[1], NULL, relay_chunk(len, total),
+                   SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == 0) break; /* EOF */
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL && total == 0)
+                return relay_copy(fromfd, tofd, len);
+            return -1;
+        }
+        /* pipe -> socket, drain all of it so the pipe is empty for reuse */
+        while (n > 0) {
+            m = splice(p[0], NULL, tofd, NULL, n,
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m < 0 && errno == EINTR) continue;
+            if (m <= 0) {
+                /* stale bytes would leak into the next response, so this
+                 * pipe is done for. a new one is made on next call */
+                int saved = errno;
+                pthread_setspecific(pipe_key, NULL);
+                pipe_free(p);
+                errno = saved;
+                return -1;
+            }
+            n -= m;
+            total += m;
+        }
+    }
+    return total;
+}
@@ -0,0 +1,14 @@
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include <sys/types.h>
+
+/*
+ * move len bytes, or everything up to EOF if len < 0, from fromfd to tofd
+ * with splice(), through a pipe owned by the calling thread, so the bytes
+ * never enter user space. falls back to read/write if the descriptors
+ * cannot be spliced. return bytes moved, or -1 with errno set
+ */
+ssize_t relay_splice(int fromfd, int tofd, ssize_t len);
+
+#endif /* __RELAY_H__ */
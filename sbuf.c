@@ -2,16 +2,44 @@
 #include "csapp.h"
 #include "sbuf.h"
 
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/* times to retry a full or empty buffer before sleeping */
+#define SBUF_SPINS 64
+
+/* sleep while *ev still equals val, until woken or timeout passes */
+static void ev_wait(unsigned *ev, unsigned val, struct timespec *timeout)
+{
+    syscall(SYS_futex, ev, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+/* wake one sleeper on ev if there is any */
+static void ev_signal(unsigned *ev, int *waiters)
+{
+    /* a sleeper counts itself in waiters before its last look at the
+     * buffer, so either it sees our change or we see it */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_RELAXED) == 0)
+        return;
+    __atomic_add_fetch(ev, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, ev, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
 /* Create an empty, bounded, shared FIFO buffer with n slots */
 /* $begin sbuf_init */
 void sbuf_init(sbuf_t *sp, int n)
 {
-    sp->buf = Calloc(n, sizeof(int)); 
-    sp->n = n;                       /* Buffer holds max of n items */
+    unsigned size = 1;
+    while (size < (unsigned)n)
+        size <<= 1;
+    sp->buf = Calloc(size, sizeof(sbuf_slot_t));
+    sp->mask = size - 1;
+    for (unsigned i = 0; i < size; i++)
+        sp->buf[i].seq = i;          /* Slot i is free for producer i */
     sp->front = sp->rear = 0;        /* Empty buffer iff front == rear */
-    Sem_init(&sp->mutex, 0, 1);      /* Binary semaphore for locking */
-    Sem_init(&sp->slots, 0, n);      /* Initially, buf has n empty slots */
-    Sem_init(&sp->items, 0, 0);      /* Initially, buf has zero data items */
+    sp->items_ev = sp->slots_ev = 0;
+    sp->items_waiters = sp->slots_waiters = 0;
 }
 /* $end sbuf_init */
 
@@ -23,15 +51,78 @@ void sbuf_deinit(sbuf_t *sp)
 }
 /* $end sbuf_deinit */
 
+/* Insert item onto the rear of shared buffer sp, 0 if it is full */
+int sbuf_try_insert(sbuf_t *sp, int item)
+{
+    unsigned pos = __atomic_load_n(&sp->rear, __ATOMIC_RELAXED);
+    sbuf_slot_t *slot;
+
+    while (1) {
+        slot = &sp->buf[pos & sp->mask];
+        int diff = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            /* our turn, claim the slot (a failed CAS reloads pos) */
+            if (__atomic_compare_exchange_n(&sp->rear, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return 0;                /* Not yet removed from a lap ago */
+        } else {
+            pos = __atomic_load_n(&sp->rear, __ATOMIC_RELAXED);
+        }
+    }
+    slot->item = item;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Remove the first item from buffer sp into *item, 0 if it is empty */
+int sbuf_try_remove(sbuf_t *sp, int *item)
+{
+    unsigned pos = __atomic_load_n(&sp->front, __ATOMIC_RELAXED);
+    sbuf_slot_t *slot;
+
+    while (1) {
+        slot = &sp->buf[pos & sp->mask];
+        int diff =
+            (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&sp->front, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return 0;                /* Not inserted yet */
+        } else {
+            pos = __atomic_load_n(&sp->front, __ATOMIC_RELAXED);
+        }
+    }
+    *item = slot->item;
+    /* free for the producer one lap later */
+    __atomic_store_n(&slot->seq, pos + sp->mask + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
 /* Insert item onto the rear of shared buffer sp */
 /* $begin sbuf_insert */
 void sbuf_insert(sbuf_t *sp, int item)
 {
-    P(&sp->slots);                          /* Wait for available slot */
-    P(&sp->mutex);                          /* Lock the buffer */
-    sp->buf[(++sp->rear)%(sp->n)] = item;   /* Insert the item */
-    V(&sp->mutex);                          /* Unlock the buffer */
-    V(&sp->items);                          /* Announce available item */
+    for (int spins = 0; !sbuf_try_insert(sp, item); spins++) {
+        if (spins < SBUF_SPINS)
+            continue;
+        /* full: announce ourselves, look again, then sleep */
+        unsigned ev = __atomic_load_n(&sp->slots_ev, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&sp->slots_waiters, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        int done = sbuf_try_insert(sp, item);
+        if (!done)
+            ev_wait(&sp->slots_ev, ev, NULL);
+        __atomic_sub_fetch(&sp->slots_waiters, 1, __ATOMIC_SEQ_CST);
+        if (done)
+            break;
+    }
+    ev_signal(&sp->items_ev, &sp->items_waiters); /* Announce the item */
 }
 /* $end sbuf_insert */
 
@@ -40,13 +131,62 @@ void sbuf_insert(sbuf_t *sp, int item)
 int sbuf_remove(sbuf_t *sp)
 {
     int item;
-    P(&sp->items);                          /* Wait for available item */
-    P(&sp->mutex);                          /* Lock the buffer */
-    item = sp->buf[(++sp->front)%(sp->n)];  /* Remove the item */
-    V(&sp->mutex);                          /* Unlock the buffer */
-    V(&sp->slots);                          /* Announce available slot */
+    sbuf_remove_timed(sp, &item, -1);
     return item;
 }
 /* $end sbuf_remove */
-/* $end sbufc */
 
+/* Remove the first item from buffer sp into *item, waiting for at most ms
+ * milliseconds (forever if ms < 0), return 0 if none came */
+int sbuf_remove_timed(sbuf_t *sp, int *item, int ms)
+{
+    struct timespec now, deadline, left;
+
+    if (ms >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += ms / 1000;
+        deadline.tv_nsec += (ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+    for (int spins = 0; !sbuf_try_remove(sp, item); spins++) {
+        if (spins < SBUF_SPINS)
+            continue;
+        if (ms >= 0) {
+            /* futex timeouts are relative, on the monotonic clock */
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left.tv_sec = deadline.tv_sec - now.tv_sec;
+            left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (left.tv_nsec < 0) {
+                left.tv_sec--;
+                left.tv_nsec += 1000000000L;
+            }
+            if (left.tv_sec < 0)
+                return 0;
+        }
+        /* empty: announce ourselves, look again, then sleep */
+        unsigned ev = __atomic_load_n(&sp->items_ev, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&sp->items_waiters, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        int done = sbuf_try_remove(sp, item);
+        if (!done)
+            ev_wait(&sp->items_ev, ev, ms >= 0 ? &left : NULL);
+        __atomic_sub_fetch(&sp->items_waiters, 1, __ATOMIC_SEQ_CST);
+        if (done)
+            break;
+    }
+    ev_signal(&sp->slots_ev, &sp->slots_waiters); /* Announce the slot */
+    return 1;
+}
+
+/* Number of items in buffer sp, others may change it right after */
+int sbuf_count(sbuf_t *sp)
+{
+    unsigned front = __atomic_load_n(&sp->front, __ATOMIC_RELAXED);
+    unsigned rear = __atomic_load_n(&sp->rear, __ATOMIC_RELAXED);
+    /* claimed but not yet filled slots count too */
+    return (int)(rear - front) > 0 ? (int)(rear - front) : 0;
+}
+/* $end sbufc */
@@ -1,20 +1,41 @@
 #include "csapp.h"
 
 /* $begin sbuft */
+/*
+ * a bounded lock-free multi-producer multi-consumer ring (Dmitry Vyukov's
+ * sequence ring). every slot carries a sequence number that tells whose
+ * turn it is: pos when it is free for the producer at pos, pos + 1 when it
+ * holds the item for the consumer at pos. threads only sleep, on a futex,
+ * when the ring is empty or full
+ */
 typedef struct {
-    int *buf;          /* Buffer array */         
-    int n;             /* Maximum number of slots */
-    int front;         /* buf[(front+1)%n] is first item */
-    int rear;          /* buf[rear%n] is last item */
-    sem_t mutex;       /* Protects accesses to buf */
-    sem_t slots;       /* Counts available slots */
-    sem_t items;       /* Counts available items */
+    unsigned seq;      /* Turn of this slot, see above */
+    int item;
+} sbuf_slot_t;
+
+typedef struct {
+    sbuf_slot_t *buf;  /* Buffer array */
+    unsigned mask;     /* Number of slots - 1, a power of 2 */
+    /* producers and consumers each bump their own line */
+    unsigned rear __attribute__((aligned(64)));  /* next slot to insert */
+    unsigned front __attribute__((aligned(64))); /* next slot to remove */
+    /* event counts to sleep on, bumped when waiters need waking */
+    unsigned items_ev __attribute__((aligned(64)));
+    unsigned slots_ev;
+    int items_waiters; /* Consumers asleep or going to sleep */
+    int slots_waiters; /* Producers asleep or going to sleep */
 } sbuf_t;
 /* $end sbuft */
 
+/* n is rounded up to a power of 2 */
 void sbuf_init(sbuf_t *sp, int n);
 void sbuf_deinit(sbuf_t *sp);
 void sbuf_insert(sbuf_t *sp, int item);
 int sbuf_remove(sbuf_t *sp);
-
-
+/* non-blocking versions, return 0 if the buffer is full / empty */
+int sbuf_try_insert(sbuf_t *sp, int item);
+int sbuf_try_remove(sbuf_t *sp, int *item);
+/* like sbuf_remove, but give up and return 0 after ms milliseconds */
+int sbuf_remove_timed(sbuf_t *sp, int *item, int ms);
+/* number of items in the buffer, only a snapshot */
+int sbuf_count(sbuf_t *sp);
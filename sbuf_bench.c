@@ -0,0 +1,129 @@
+/*
+ * sbuf_bench.c - enqueue/dequeue throughput of sbuf against the semaphore
+ * buffer it replaced
+ *
+ * usage: sbuf_bench [producers [consumers [items [slots]]]]
+ */
+#include "csapp.h"
+#include "sbuf.h"
+
+/* the CS:APP buffer sbuf used to be: three semaphores per operation */
+typedef struct {
+    int *buf;
+    int n;
+    int front;
+    int rear;
+    sem_t mutex;
+    sem_t slots;
+    sem_t items;
+} sem_sbuf_t;
+
+static void sem_sbuf_init(sem_sbuf_t *sp, int n)
+{
+    sp->buf = Calloc(n, sizeof(int));
+    sp->n = n;
+    sp->front = sp->rear = 0;
+    Sem_init(&sp->mutex, 0, 1);
+    Sem_init(&sp->slots, 0, n);
+    Sem_init(&sp->items, 0, 0);
+}
+
+static void sem_sbuf_insert(sem_sbuf_t *sp, int item)
+{
+    P(&sp->slots);
+    P(&sp->mutex);
+    sp->buf[(++sp->rear) % (sp->n)] = item;
+    V(&sp->mutex);
+    V(&sp->items);
+}
+
+static int sem_sbuf_remove(sem_sbuf_t *sp)
+{
+    int item;
+    P(&sp->items);
+    P(&sp->mutex);
+    item = sp->buf[(++sp->front) % (sp->n)];
+    V(&sp->mutex);
+    V(&sp->slots);
+    return item;
+}
+
+static int nproducers = 4, nconsumers = 4, nitems = 1000000, nslots = 16;
+static int use_sem;
+static sbuf_t sbuf;
+static sem_sbuf_t sem_sbuf;
+static long sums[64];
+
+static void *producer(void *vargp)
+{
+    int id = (int)(long)vargp;
+    /* items are 1..nitems, split among producers */
+    for (int i = id + 1; i <= nitems; i += nproducers) {
+        if (use_sem)
+            sem_sbuf_insert(&sem_sbuf, i);
+        else
+            sbuf_insert(&sbuf, i);
+    }
+    return NULL;
+}
+
+static void *consumer(void *vargp)
+{
+    int id = (int)(long)vargp;
+    int n = nitems / nconsumers + (id < nitems % nconsumers);
+    long sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += use_sem ? sem_sbuf_remove(&sem_sbuf) : sbuf_remove(&sbuf);
+    sums[id] = sum;
+    return NULL;
+}
+
+/* run one round, return items per second */
+static double run(void)
+{
+    pthread_t tids[128];
+    struct timespec t0, t1;
+    long sum = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (long i = 0; i < nconsumers; i++)
+        Pthread_create(&tids[i], NULL, consumer, (void *)i);
+    for (long i = 0; i < nproducers; i++)
+        Pthread_create(&tids[nconsumers + i], NULL, producer, (void *)i);
+    for (int i = 0; i < nconsumers + nproducers; i++)
+        Pthread_join(tids[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    for (int i = 0; i < nconsumers; i++)
+        sum += sums[i];
+    if (sum != (long)nitems * (nitems + 1) / 2)
+        app_error("items were lost or duplicated");
+    return nitems / ((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) nproducers = atoi(argv[1]);
+    if (argc > 2) nconsumers = atoi(argv[2]);
+    if (argc > 3) nitems = atoi(argv[3]);
+    if (argc > 4) nslots = atoi(argv[4]);
+    if (nproducers < 1 || nproducers > 64 || nconsumers < 1 ||
+        nconsumers > 64 || nitems < 1 || nslots < 1) {
+        fprintf(stderr,
+                "usage: %s [producers [consumers [items [slots]]]]\n",
+                argv[0]);
+        exit(1);
+    }
+
+    sem_sbuf_init(&sem_sbuf, nslots);
+    sbuf_init(&sbuf, nslots);
+    use_sem = 1;
+    printf("%d producers, %d consumers, %d items, %d slots\n", nproducers,
+           nconsumers, nitems, nslots);
+    printf("semaphores: %.0f items/s\n", run());
+    use_sem = 0;
+    printf("lock-free:  %.0f items/s\n", run());
+    sbuf_deinit(&sbuf);
+    Free(sem_sbuf.buf);
+    return 0;
+}
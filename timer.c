@@ -0,0 +1,66 @@
+/*
+ * timer.c - a timer wheel with a slot per second
+ *
+ * Event loops time out idle clients and slow connects. Timeouts are whole
+ * seconds, so a timer goes into the slot of the second it expires in:
+ * arming and cancelling are a list insert and unlink, and a sweep only
+ * looks at the slots of the seconds that passed since the last one.
+ */
+#include "timer.h"
+
+#include <stddef.h>
+
+void wheel_init(timer_wheel *w) {
+    for (int i = 0; i < TIMER_SLOTS; ++i)
+        w->slots[i].prev = w->slots[i].next = &w->slots[i];
+    w->now = time(NULL);
+    w->armed = 0;
+}
+
+void wheel_cancel(timer_wheel *w, wheel_timer *t) {
+    if (t->expires == 0) return;
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->expires = 0;
+    w->armed--;
+}
+
+void wheel_arm(timer_wheel *w, wheel_timer *t, int seconds) {
+    wheel_timer *head;
+
+    wheel_cancel(w, t);
+    t->expires = time(NULL) + seconds;
+    /* a sweep may have gone past this second already */
+    if (t->expires < w->now) t->expires = w->now;
+    head = &w->slots[t->expires % TIMER_SLOTS];
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+    w->armed++;
+}
+
+wheel_timer *wheel_expired(timer_wheel *w, time_t now) {
+    /* after a long sleep, every slot is looked at once */
+    if (now - w->now >= TIMER_SLOTS) w->now = now - TIMER_SLOTS + 1;
+    for (; w->armed && w->now <= now; ++w->now) {
+        wheel_timer *head = &w->slots[w->now % TIMER_SLOTS];
+        for (wheel_timer *t = head->next; t != head; t = t->next)
+            if (t->expires <= now) {
+                wheel_cancel(w, t);
+                return t;
+            }
+    }
+    /* sweep this second again next time, it may get more timers */
+    w->now = now;
+    return NULL;
+}
+
+int wheel_timeout(timer_wheel *w) {
+    struct timespec ts;
+
+    if (w->armed == 0) return -1;
+    /* wake at the start of the next second */
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return 1000 - ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,34 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <time.h>
+
+/* slots of a wheel, one per second. a timer further away than that waits
+ * in its slot for as many turns as it needs */
+#define TIMER_SLOTS 64
+
+/* embedded in whatever it times, see wheel_expired */
+typedef struct wheel_timer {
+    time_t expires; /* 0 if not armed */
+    struct wheel_timer *prev, *next;
+} wheel_timer;
+
+/* the timers of one event loop, not shared between threads */
+typedef struct {
+    wheel_timer slots[TIMER_SLOTS]; /* list heads */
+    time_t now;                     /* slots before it have been swept */
+    int armed;                      /* timers in the wheel */
+} timer_wheel;
+
+void wheel_init(timer_wheel *w);
+/* (re)arm t to expire seconds from now */
+void wheel_arm(timer_wheel *w, wheel_timer *t, int seconds);
+/* disarm t, it need not be armed */
+void wheel_cancel(timer_wheel *w, wheel_timer *t);
+/* disarm and return a timer that expired by now, NULL if there is none */
+wheel_timer *wheel_expired(timer_wheel *w, time_t now);
+/* milliseconds an event loop may sleep before it should sweep, -1 if no
+ * timer is armed */
+int wheel_timeout(timer_wheel *w);
+
+#endif /* __TIMER_H__ */
@@ -0,0 +1,220 @@
+/*
+ * upstream.c - a pool of idle keep-alive connections to end servers
+ *
+ * Most requests go to a handful of servers, so instead of a DNS lookup,
+ * TCP handshake and slow start for every object, a finished connection
+ * waits here for the next request to the same host and port. Connections
+ * are shared by all threads, each hash bucket has its own lock.
+ */
+#include "upstream.h"
+
+#include <poll.h>
+
+#include "csapp.h"
+#include "dns.h"
+
+typedef struct idle_conn {
+    int fd;
+    int port;
+    time_t since; /* when it went idle */
+    struct idle_conn *next;
+    char host[];
+} idle_conn;
+
+static struct {
+    idle_conn *head; /* most recently idle first */
+    pthread_mutex_t lock;
+} buckets[UPSTREAM_BUCKETS] = {[0 ... UPSTREAM_BUCKETS - 1] = {
+                                   NULL, PTHREAD_MUTEX_INITIALIZER}};
+
+static unsigned bucket_of(const char *host, int port) {
+    unsigned h = 2166136261u; /* FNV-1a */
+    for (; *host; ++host) h = (h ^ (unsigned char)*host) * 16777619u;
+    return (h ^ port) % UPSTREAM_BUCKETS;
+}
+
+/* an idle connection is fine if reading it would block: nothing came and
+ * the server hasn't closed it */
+static int healthy(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* alternate address families, starting with the one the resolver put
+ * first, so a family that doesn't work costs one attempt, not all */
+static void interleave(dns_addrs *a) {
+    dns_addrs out = {0};
+    int used[DNS_MAX_ADDRS] = {0}, family = a->addr[0].ss_family, i;
+
+    while (out.n < a->n) {
+        for (i = 0; i < a->n && (used[i] || a->addr[i].ss_family != family);
+             ++i)
+            ;
+        if (i == a->n) /* none of that family left */
+            for (i = 0; used[i]; ++i)
+                ;
+        used[i] = 1;
+        out.addr[out.n] = a->addr[i];
+        out.len[out.n++] = a->len[i];
+        family = a->addr[i].ss_family == AF_INET6 ? AF_INET : AF_INET6;
+    }
+    *a = out;
+}
+
+/* start a non-blocking connect, -1 if it failed at once */
+static int start_connect(struct sockaddr_storage *addr, socklen_t len) {
+    int fd = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+    if (fd >= 0 && connect(fd, (struct sockaddr *)addr, len) < 0 &&
+        errno != EINPROGRESS) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/*
+ * connect to whichever address of host answers first. attempts start
+ * UPSTREAM_ATTEMPT_DELAY ms apart, or as soon as the previous one fails,
+ * and run together, so an address that drops our SYNs only delays us by
+ * that much. the winner is returned blocking, the others are closed
+ */
+static int open_conn(char *host, int port) {
+    char port_str[16];
+    dns_addrs addrs;
+    struct pollfd fds[DNS_MAX_ADDRS];
+    int fd = -1, nfds = 0, next = 0, rc;
+    int64_t now = now_ms(), deadline = now + UPSTREAM_CONNECT_TIMEOUT;
+    int64_t next_start = now;
+
+    sprintf(port_str, "%d", port);
+    if ((rc = dns_lookup(host, port_str, &addrs)) != 0) {
+        fprintf(stderr, "dns_lookup failed (%s:%s): %s\n", host, port_str,
+                gai_strerror(rc));
+        return -1;
+    }
+    if (addrs.n == 0) return -1;
+    interleave(&addrs);
+
+    while (fd < 0 && (next < addrs.n || nfds > 0) &&
+           (now = now_ms()) < deadline) {
+        if (next < addrs.n && now >= next_start) {
+            int s = start_connect(&addrs.addr[next], addrs.len[next]);
+            next++;
+            if (s >= 0) {
+                fds[nfds].fd = s;
+                fds[nfds++].events = POLLOUT;
+                next_start = now + UPSTREAM_ATTEMPT_DELAY;
+            }
+            continue;
+        }
+        int64_t until = deadline;
+        if (next < addrs.n && next_start < until) until = next_start;
+        if (poll(fds, nfds, until - now) < 0 && errno != EINTR) break;
+        for (int i = 0; i < nfds;) {
+            int err = 0;
+            socklen_t errlen = sizeof(err);
+            if (!fds[i].revents) {
+                ++i;
+                continue;
+            }
+            getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+            if (!err && fd < 0)
+                fd = fds[i].fd;
+            else
+                close(fds[i].fd);
+            /* a failed attempt hands over to the next one at once */
+            if (err) next_start = now;
+            fds[i] = fds[--nfds];
+        }
+    }
+    for (int i = 0; i < nfds; ++i) close(fds[i].fd);
+
+    if (fd < 0) {
+        fprintf(stderr, "connect failed (%s:%s): %s\n", host, port_str,
+                now >= deadline ? "timed out" : "no address answered");
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    return fd;
+}
+
+int upstream_get(char *host, int port, int *reused) {
+    unsigned b = bucket_of(host, port);
+    time_t now = time(NULL);
+    idle_conn *found = NULL, *stale = NULL, **pp;
+
+    pthread_mutex_lock(&buckets[b].lock);
+    for (pp = &buckets[b].head; *pp && !found;) {
+        idle_conn *c = *pp;
+        if (now - c->since > UPSTREAM_IDLE_TIMEOUT) {
+            /* too old to trust, and so is everything after it */
+            *pp = NULL;
+            stale = c;
+            break;
+        }
+        if (c->port == port && !strcmp(c->host, host)) {
+            *pp = c->next;
+            found = c;
+        } else {
+            pp = &c->next;
+        }
+    }
+    pthread_mutex_unlock(&buckets[b].lock);
+
+    /* close outside the lock */
+    while (stale) {
+        idle_conn *next = stale->next;
+        close(stale->fd);
+        free(stale);
+        stale = next;
+    }
+    if (found) {
+        int fd = found->fd;
+        free(found);
+        if (healthy(fd)) {
+            *reused = 1;
+            return fd;
+        }
+        close(fd);
+    }
+
+    *reused = 0;
+    return open_conn(host, port);
+}
+
+void upstream_put(char *host, int port, int fd) {
+    unsigned b = bucket_of(host, port);
+    idle_conn *c = Malloc(sizeof(idle_conn) + strlen(host) + 1), **pp;
+    idle_conn *old = NULL;
+    int n = 0;
+
+    c->fd = fd;
+    c->port = port;
+    c->since = time(NULL);
+    strcpy(c->host, host);
+
+    pthread_mutex_lock(&buckets[b].lock);
+    c->next = buckets[b].head;
+    buckets[b].head = c;
+    /* keep UPSTREAM_MAX_IDLE of this host, drop the one idle longest */
+    for (pp = &c->next; *pp; pp = &(*pp)->next)
+        if ((*pp)->port == port && !strcmp((*pp)->host, host) &&
+            ++n == UPSTREAM_MAX_IDLE) {
+            old = *pp;
+            *pp = old->next;
+            break;
+        }
+    pthread_mutex_unlock(&buckets[b].lock);
+    if (old) {
+        close(old->fd);
+        free(old);
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+/* idle keep-alive connections kept per (host, port), and for how long */
+#define UPSTREAM_MAX_IDLE 8
+#define UPSTREAM_IDLE_TIMEOUT 30 /* seconds */
+#define UPSTREAM_BUCKETS 64
+/* a new connection races the addresses of a host, starting the next one
+ * when the last has had UPSTREAM_ATTEMPT_DELAY ms alone (RFC 8305), and
+ * gives up after UPSTREAM_CONNECT_TIMEOUT ms */
+#define UPSTREAM_ATTEMPT_DELAY 250
+#define UPSTREAM_CONNECT_TIMEOUT 5000
+
+/*
+ * return a connection to host:port, an idle one from the pool if a healthy
+ * one is there (*reused is set then), otherwise a new one. -1 if it
+ * failed. a reused connection may still have been closed by the server
+ * just now, so if it fails before any response byte, try a new one
+ */
+int upstream_get(char *host, int port, int *reused);
+/* give back a connection whose last response was read to its end, so the
+ * next request to host:port can use it. it is closed if the pool is full */
+void upstream_put(char *host, int port, int fd);
+
+#endif /* __UPSTREAM_H__ */
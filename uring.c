@@ -0,0 +1,117 @@
+#include "uring.h"
+
+#include <sys/syscall.h>
+
+#include "csapp.h"
+
+int uring_init(uring_t *ring, unsigned entries) {
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(ring, 0, sizeof(uring_t));
+    memset(&p, 0, sizeof(p));
+    if ((ring->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) return -1;
+
+    ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_sz =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    /* newer kernels map both rings with one mmap */
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_sz > ring->sq_ring_sz)
+            ring->sq_ring_sz = ring->cq_ring_sz;
+        ring->cq_ring_sz = ring->sq_ring_sz;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) goto fail;
+    }
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) goto fail;
+
+    sq = ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    cq = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    /* uring_deinit does not know what we have mapped, so undo it here */
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_sz);
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED &&
+        ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_sz);
+    close(ring->fd);
+    return -1;
+}
+
+void uring_deinit(uring_t *ring) {
+    munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+    if (ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_sz);
+    munmap(ring->sq_ring, ring->sq_ring_sz);
+    close(ring->fd);
+}
+
+int uring_register_buffers(uring_t *ring, struct iovec *iov, unsigned n) {
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS,
+                   iov, n);
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        /* ring is full, let the kernel consume what we have queued */
+        if (uring_submit_and_wait(ring, 0) < 0) return NULL;
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sqe_tail - head >= ring->sq_entries) return NULL;
+    }
+    unsigned idx = ring->sqe_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    ring->sq_array[idx] = idx;
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+int uring_submit_and_wait(uring_t *ring, unsigned wait_nr) {
+    /* count from head, so sqes the kernel skipped last time are retried */
+    unsigned to_submit =
+        ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+
+    /* the kernel must see the sqes before it sees the new tail */
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    if (to_submit == 0 && wait_nr == 0) return 0;
+    return syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr, flags,
+                   NULL, 0);
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,41 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+#include "csapp.h"
+
+/* a bare io_uring instance, mapped by hand since we do not use liburing */
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;      /* sqes handed out, *sq_tail is what's submitted */
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring; /* the same mapping with IORING_FEAT_SINGLE_MMAP */
+    size_t sq_ring_sz, cq_ring_sz;
+} uring_t;
+
+/* create and map a ring with entries sqes, return -1 with errno set */
+int uring_init(uring_t *ring, unsigned entries);
+/* unmap and close the ring */
+void uring_deinit(uring_t *ring);
+/* pin iov as fixed buffers for READ_FIXED/WRITE_FIXED, -1 with errno set */
+int uring_register_buffers(uring_t *ring, struct iovec *iov, unsigned n);
+/* return a zeroed sqe to fill, submitting queued ones if the ring is full */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+/* submit every queued sqe in one syscall, then wait for wait_nr cqes */
+int uring_submit_and_wait(uring_t *ring, unsigned wait_nr);
+/* return the next cqe without waiting, or NULL if there is none */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+/* hand the cqe returned by uring_peek_cqe back to the kernel */
+void uring_cqe_seen(uring_t *ring);
+
+/* io_uring proxy engine in proxy_uring.c, serves clients of listenfd
+ * forever. return -1 if io_uring is unavailable on this kernel */
+int uring_serve(int listenfd);
+
+#endif /* __URING_H__ */